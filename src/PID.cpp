@@ -1,16 +1,80 @@
-#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
 #include "PID.h"
+#include "logger.h"
+#include "checkpoint.h"
 
 /**
  * TODO: Complete the PID class. You may add any additional desired functions.
  */
 
-PID::PID() {}
+constexpr double PID::MAX_MEASURED_DT;
+
+PID::PID() {
+	timing = Timing::SPEED;
+	last_dt = 0;
+	SetCostTerms(COST_CTE);
+	total_samplelen = 0;
+	ResolveScoreWindow();
+	early_stop_active = false;
+	cost_limit_active = false;
+	cost_limit = 0;
+	stop_reason = StopReason::NONE;
+}
 
 PID::~PID() {}
 
 void PID::Set_Train_SampleLen(int _total_samplelen) {
 	total_samplelen = _total_samplelen;
+	ResolveScoreWindow();
+}
+
+void PID::SetScoreWindow(const ScoreWindow& window) {
+	score_window = window;
+	ResolveScoreWindow();
+}
+
+void PID::ResolveScoreWindow() {
+	if (total_samplelen <= 0)
+	{
+		// the length of the run is unknown, the counting from the end is not possible
+		score_begin = std::max(0, score_window.begin);
+		score_end = score_window.end > 0 ? score_window.end : INT_MAX;
+		score_len = score_end - score_begin;
+		return;
+	}
+	score_begin = score_window.begin < 0 ? total_samplelen + score_window.begin : score_window.begin;
+	score_end = score_window.end <= 0 ? total_samplelen + score_window.end : score_window.end;
+	score_begin = std::max(0, std::min(total_samplelen, score_begin));
+	score_end = std::max(0, std::min(total_samplelen, score_end));
+	if (score_begin >= score_end)
+	{
+		// an empty window would have no cost value at all
+		score_begin = 0;
+		score_end = total_samplelen;
+	}
+	score_len = score_end - score_begin;
+}
+
+void PID::SetEarlyStop(const EarlyStopConfig& _early_stop) {
+	early_stop = _early_stop;
+	cost_limit_active = early_stop.cost_limit && cost_limit > 0 && objective.kind == Objective::MEAN;
+	early_stop_active = early_stop.max_cte > 0 || cost_limit_active || early_stop.min_speed > 0;
+}
+
+void PID::SetObjective(const Objective& _objective) {
+	objective = _objective;
+	stats.cost_quantile = P2Quantile(objective.quantile);
+	SelectUpdate();
+	SetEarlyStop(early_stop);
+}
+
+void PID::SetCostLimit(double best_err) {
+	// the cost value is the average of the scored samples of the whole run, so it can't be below best_err if the sum is above this
+	cost_limit = best_err * score_len;
+	SetEarlyStop(early_stop);
 }
 
 void PID::Init(double Kp_, double Ki_, double Kd_) {
@@ -27,15 +91,55 @@ void PID::Init(double Kp_, double Ki_, double Kd_) {
 	total_cte_err = 0;
 	total_cte_len = 0;
 	sum_spd = 0;
+	max_cte2 = 0;
+	stop_reason = StopReason::NONE;
+	stats.reset();
 }
 
-void PID::UpdateError(double cte, double speed, double angle) {
+bool parse_cost_terms(const char* list, unsigned& terms)
+{
+	terms = COST_CTE;
+	while (*list)
+	{
+		const char* end = strchr(list, ',');
+		size_t len = end ? size_t(end - list) : strlen(list);
+		if (len == 3 && strncmp(list, "cte", 3) == 0)
+			;
+		else if (len == 5 && strncmp(list, "speed", 5) == 0)
+			terms |= COST_SPEED;
+		else if (len == 5 && strncmp(list, "angle", 5) == 0)
+			terms |= COST_ANGLE;
+		else
+			return false;
+		list += end ? len + 1 : len;
+	}
+	return true;
+}
+
+template <typename CostPolicy, bool STATS, bool MEASURED>
+void PID::UpdateErrorWith(double cte, double speed, double angle, int frames, double elapsed) {
 	p_error = Kp * cte;
 
 	if (speed<0.001) speed = 0.001;								// don't divide by zero
-	double dt_proportional = 100 / speed;					// this value is 100* the reciprocal of the current speed thus it's proportional to dt.
+	double dt_proportional;									// the time since the previous update
+	double i_weight, i_scale;								// the integral is i_scale * sum( i_weight * cte )
+	if (MEASURED)
+	{
+		if (elapsed > 0 && elapsed <= MAX_MEASURED_DT)
+			last_dt = elapsed;
+		dt_proportional = last_dt;
+		i_weight = last_dt;
+		i_scale = 1;
+	}
+	else
+	{
+		double frame_dt = 100 / speed;						// this value is 100* the reciprocal of the current speed thus it's proportional to dt.
+		dt_proportional = frames * frame_dt;
+		i_weight = frames;									// the dropped frames are assumed to have had the same CTE
+		i_scale = frame_dt;
+	}
 
-	if (bFirstUpdate)
+	if (bFirstUpdate || dt_proportional <= 0)				// there's no time step before the first measured one
 	{
 		d_error = 0;
 		bFirstUpdate = false;
@@ -45,41 +149,143 @@ void PID::UpdateError(double cte, double speed, double angle) {
 		d_error = Kd * (cte - prev_cte) / dt_proportional;			// Derivative -> Sum -> Multiply error by dt
 	}
 	prev_cte = cte;
-	sum_cte += cte;
-	i_error = Ki * sum_cte * dt_proportional;			// Integral -> *d/dt -> Divide error by dt
-
-#ifdef USE_SPEED_WEIGHT
-	spd_error = 2000*exp( -speed/50.0 );
-#else 
-	spd_error = 0;
-#endif
+	sum_cte += cte * i_weight;
+	i_error = Ki * sum_cte * i_scale;					// Integral -> *d/dt -> Divide error by dt
 
-#ifdef USE_ANGLE_WEIGHT
-	angle_error = 1000 * ( 1 - exp(-abs(angle) / 25.0) );
-#else 
-	angle_error = 0;
-#endif
-
-//	if (double(total_samplelen)*0.8 < samplenum )			// only use the second half of this run
+	if (samplenum >= score_begin && samplenum < score_end)		// only the samples in the scoring window
 	{
-		total_cte_err += cte * cte + spd_error + angle_error;
+		double cost = CostPolicy::cost(cte, speed, angle);
+		total_cte_err += cost;
+		if (STATS)
+		{
+			stats.add(cost, fabs(cte));
+		}
 		sum_spd += speed;
 		total_cte_len++;
 	}
+
+	if (early_stop_active)
+	{
+		CheckEarlyStop(cte, speed);
+	}
+}
+
+// The cost policies of the CostTerms combinations, indexed by the flags
+typedef CostSum<CteCost> CostCte;
+typedef CostSum<CteCost, SpeedWeightCost> CostCteSpeed;
+typedef CostSum<CteCost, AngleWeightCost> CostCteAngle;
+typedef CostSum<CteCost, SpeedWeightCost, AngleWeightCost> CostCteSpeedAngle;
+
+void PID::SetCostTerms(unsigned terms) {
+	cost_terms = terms % COST_TERMS_COUNT;
+	SelectUpdate();
+}
+
+template <bool STATS, bool MEASURED>
+PID::UpdateFunction PID::UpdateFor(unsigned terms) {
+	static const UpdateFunction updates[COST_TERMS_COUNT] = {
+		&PID::UpdateErrorWith<CostCte, STATS, MEASURED>,
+		&PID::UpdateErrorWith<CostCteSpeed, STATS, MEASURED>,
+		&PID::UpdateErrorWith<CostCteAngle, STATS, MEASURED>,
+		&PID::UpdateErrorWith<CostCteSpeedAngle, STATS, MEASURED>,
+	};
+	return updates[terms];
+}
+
+void PID::SelectUpdate() {
+	bool stats = objective.kind != Objective::MEAN;
+	if (timing == Timing::MEASURED)
+		update = stats ? UpdateFor<true, true>(cost_terms) : UpdateFor<false, true>(cost_terms);
+	else
+		update = stats ? UpdateFor<true, false>(cost_terms) : UpdateFor<false, false>(cost_terms);
+}
+
+void PID::SetTiming(Timing _timing) {
+	timing = _timing;
+	SelectUpdate();
+}
+
+bool parse_timing(const char* name, Timing& timing)
+{
+	if (strcmp(name, "speed") == 0)
+		timing = Timing::SPEED;
+	else if (strcmp(name, "measured") == 0)
+		timing = Timing::MEASURED;
+	else
+		return false;
+	return true;
+}
+
+PID::SampleCost PID::CostFunction(unsigned terms) {
+	static const SampleCost costs[COST_TERMS_COUNT] = {
+		&CostCte::cost,
+		&CostCteSpeed::cost,
+		&CostCteAngle::cost,
+		&CostCteSpeedAngle::cost,
+	};
+	return costs[terms % COST_TERMS_COUNT];
+}
+
+void PID::CheckEarlyStop(double cte, double speed) {
+	if (cte * cte > max_cte2)
+		max_cte2 = cte * cte;
+	if (stop_reason != StopReason::NONE)
+		return;
+	if (early_stop.max_cte > 0 && fabs(cte) > early_stop.max_cte)
+		stop_reason = StopReason::CTE;
+	else if (cost_limit_active && total_cte_err > cost_limit)
+		stop_reason = StopReason::COST;
+	else if (early_stop.min_speed > 0 && samplenum >= early_stop.warmup && speed < early_stop.min_speed)
+		stop_reason = StopReason::SPEED;
 }
 
 // get the average cost value for the simulation just finished
 double PID::GetCostValue(PIDTRAINER * pt) {
 
-#ifdef USE_LOGGING
 	if (pt)
 	{
-		pt->logfile << "AVG speed was: " << (sum_spd / total_cte_len) << " mph." << endl;
+		LOG(LogChannel::TRAINING, LogLevel::INFO, "AVG speed was: {} mph.", total_cte_len ? sum_spd / total_cte_len : 0);
+	}
+	if (objective.kind != Objective::MEAN)
+	{
+		return GetObjectiveValue(pt);
+	}
+	switch (stop_reason) {
+	case StopReason::COST:
+		// a lower bound of the cost value of the whole run, it's already above the best one
+		return total_cte_err / score_len;
+	case StopReason::CTE:
+	case StopReason::SPEED:
+		// the remaining scored samples of the run are penalized with the worst CTE of the run ( at least the CTE limit )
+		if (score_len > total_cte_len)
+		{
+			double penalty = std::max(max_cte2, early_stop.max_cte * early_stop.max_cte);
+			return (total_cte_err + penalty * (score_len - total_cte_len)) / score_len;
+		}
+		break;
+	default:
+		break;
 	}
-#endif 
 	return total_cte_err / total_cte_len;
 }
 
+double PID::GetObjectiveValue(PIDTRAINER* pt) const {
+	RunStats run = stats;
+	if ((stop_reason == StopReason::CTE || stop_reason == StopReason::SPEED) && score_len > total_cte_len)
+	{
+		// the remaining samples of the stopped run are penalized like in the average ( the cost_limit rule is not used with the statistics )
+		double penalty = std::max(max_cte2, early_stop.max_cte * early_stop.max_cte);
+		for (int i = total_cte_len; i < score_len; i++)
+			run.add(penalty, run.max_abs_cte);
+	}
+	if (pt)
+	{
+		LOG(LogChannel::TRAINING, LogLevel::INFO, "Sample cost mean: {} std: {} p{}: {} max: {} max|cte|: {}", run.cost.mean(), run.cost.stddev(),
+			objective.quantile * 100, run.cost_quantile.value(), run.cost.max(), run.max_abs_cte);
+	}
+	return run.value(objective);
+}
+
 double PID::TotalError() {
   samplenum++;
   return -p_error -i_error -d_error;  
@@ -88,109 +294,190 @@ double PID::TotalError() {
 // PIDTRAINER
 
 PIDTRAINER::PIDTRAINER(PID* _pid, int _target_samplenum, double _p, double _i, double _d, double d1, double d2, double d3)
+{
+	double p[3] = { _p, _i, _d };
+	double d[3] = { d1, d2, d3 };
+	target_samplenum = _target_samplenum;
+	pid = _pid;
+	optimizer.reset(new Twiddle(p, d));
+	runs = 0;
+	aborted_runs = 0;
+	best_err = 0;
+	pid->Set_Train_SampleLen(target_samplenum);
+	next_run();
+}
+
+PIDTRAINER::PIDTRAINER(PID* _pid, int _target_samplenum, std::unique_ptr<Optimizer> _optimizer)
+	: optimizer(std::move(_optimizer))
 {
 	target_samplenum = _target_samplenum;
 	pid = _pid;
-	deltas[0] = d1;
-	deltas[1] = d2;
-	deltas[2] = d3;
-	params[0] = _p;
-	params[1] = _i;
-	params[2] = _d;
-	curparamidx = 0;
-	curstate = START;
+	runs = 0;
+	aborted_runs = 0;
+	best_err = 0;
 	pid->Set_Train_SampleLen(target_samplenum);
-#ifdef USE_LOGGING
-	logfile.open("log.txt");
-#endif 
+	next_run();
 }
 
 PIDTRAINER::~PIDTRAINER()
 {
-#ifdef USE_LOGGING
-	logfile << "---END---" << endl;
-	logfile.close();
-#endif
+	if (!checkpoint_path.empty())
+	{
+		release_checkpoint(checkpoint_path);
+	}
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "---END---");
+	Logger::instance().flush();
+}
+
+void PIDTRAINER::next_run()
+{
+	optimizer->ask(params);
+	pid->Init(params[0], params[1], params[2]);
+	pid->SetCostLimit(runs > 0 ? best_err : 0);
+}
+
+void PIDTRAINER::set_early_stop(const EarlyStopConfig& _early_stop)
+{
+	early_stop = _early_stop;
+	// a run stopped by the cost rule is scored with a lower bound of its cost, which is only enough for twiddle's comparison with
+	// the best run. The other optimizers rank the other points too, and they would be misled by it.
+	if (early_stop.cost_limit && optimizer->kind() != OptimizerKind::TWIDDLE)
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "--stop-cost is only used with the twiddle optimizer, it's ignored");
+		early_stop.cost_limit = false;
+	}
+	pid->SetEarlyStop(early_stop);
+	pid->SetCostLimit(runs > 0 ? best_err : 0);
 }
 
 void PIDTRAINER::ready()
 {
-	if (curstate != START)
+	double err = pid->GetCostValue(this);
+	runs++;
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "run={} cur_err={} Params: {} {} {}", runs, err, params[0], params[1], params[2]);
+	if (pid->GetStopReason() != StopReason::NONE)
 	{
-#ifdef USE_LOGGING
-		logfile << "Best err: " << best_err << " Params: " << best_params[0] << " " << best_params[1] << " " << best_params[2] << " " << best_deltas[0] << " " << best_deltas[1] << " " << best_deltas[2] << " Cur_deltas[" << deltas[0] << " " << deltas[1] << " " << deltas[2] << "]" << endl;
-		logfile.flush();
-#endif
+		LOG(LogChannel::TRAINING, LogLevel::INFO, "run={} was stopped early at sample {}, reason={} ( 1: cte, 2: cost, 3: speed )", runs, pid->samplenum, int(pid->GetStopReason()));
 	}
 
-	double err;
+	if (runs == 1 || err < best_err)
+	{
+		best_found(err);
+	}
+	optimizer->tell(err);
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "Best err: {} Params: {} {} {} Step size: {}", best_err, best_params[0], best_params[1], best_params[2], optimizer->step_size());
 
-	auto execstart = [this] {
-		params[curparamidx] += deltas[curparamidx];
-		pid->Init(params[0], params[1], params[2]);
-		curstate = PARAMINCREASED;
-	};
+	next_run();
+	if (!checkpoint_path.empty())
+	{
+		save_checkpoint();
+	}
+}
+
+void PIDTRAINER::abort_run()
+{
+	aborted_runs++;
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "ABORTED run {} after {} samples, it is repeated. Params: {} {} {}", runs + 1, pid->samplenum, params[0], params[1], params[2]);
+	pid->Init(params[0], params[1], params[2]);
+}
+
+void PIDTRAINER::attach(PID* _pid)
+{
+	pid = _pid;
+	pid->Set_Train_SampleLen(target_samplenum);
+	pid->SetEarlyStop(early_stop);
+	pid->Init(params[0], params[1], params[2]);
+	pid->SetCostLimit(runs > 0 ? best_err : 0);
+}
 
-	switch (curstate) {
-	case START:
-		best_found(pid->GetCostValue(this));
+void PIDTRAINER::save_checkpoint() const
+{
+	std::string data;
+	StateWriter w(data);
+	w.put(optimizer->kind());
+	w.put(target_samplenum);
+	w.put(pid->GetObjective());
+	w.put(pid->GetScoreWindow());
+	w.put(pid->GetTiming());
+	w.put(pid->GetCostTerms());
+	w.put(runs);
+	w.put(best_err);
+	w.put(best_params);
+	optimizer->save(w);
+	if (!write_checkpoint(checkpoint_path.c_str(), data))
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "Failed to write the checkpoint file");
+	}
+}
 
-#ifdef USE_LOGGING
-		logfile << "START Best err: " << best_err << " Params: " << best_params[0] << " " << best_params[1] << " " << best_params[2] << " " << best_deltas[0] << " " << best_deltas[1] << " " << best_deltas[2] << endl;
-		logfile.flush();
-#endif
+bool PIDTRAINER::set_checkpoint(const char* path)
+{
+	if (!checkpoint_path.empty())
+	{
+		release_checkpoint(checkpoint_path);
+		checkpoint_path.clear();
+	}
+	if (!claim_checkpoint(path))
+	{
+		// e.g. the trainer of another event loop, or the parked trainer of the connection, which is adopted right after this one is created
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Another trainer of the process uses the checkpoint file, this one is not checkpointed");
+		return false;
+	}
+	checkpoint_path = path;
+	std::string data;
+	if (!read_checkpoint(path, data))
+		return false;
 
-		// while 
-		curparamidx = 0;
-		execstart();
-		break;
-	case PARAMINCREASED:
-		err = pid->GetCostValue(this);
-#ifdef USE_LOGGING
-		logfile << "state=" << int(curstate) << " curparamidx=" << curparamidx << " cur_err=" << err << endl;
-		logfile.flush();
-#endif
-
-		if (err < best_err) {
-			best_found(err);
-			deltas[curparamidx] *= 1.1;
-			curparamidx = (curparamidx + 1) % 3;
-			execstart();
-		}
-		else
-		{
-			params[curparamidx] -= 2 * deltas[curparamidx];
-			pid->Init(params[0], params[1], params[2]);
-			curstate = PARAMDECREASED;
-		}
-		break;
-	case PARAMDECREASED:
-		err = pid->GetCostValue(this);
-#ifdef USE_LOGGING
-		logfile << "state=" << int(curstate) << " curparamidx=" << curparamidx << " cur_err=" << err << endl;
-		logfile.flush();
-#endif
-
-		if (err < best_err)
-		{
-			best_found(err);
+	StateReader r(data.data(), data.size());
+	OptimizerKind kind = optimizer->kind();
+	int samplenum = 0;
+	Objective objective;
+	r.get(kind);
+	r.get(samplenum);
+	ScoreWindow window;
+	Timing timing = Timing::SPEED;
+	r.get(objective);
+	r.get(window);
+	unsigned cost_terms = COST_CTE;
+	r.get(timing);
+	r.get(cost_terms);
+	// the cost values of different objectives, windows, timings or cost terms can't be compared
+	if (!r.ok() || kind != optimizer->kind() || samplenum != target_samplenum
+		|| objective.kind != pid->GetObjective().kind || objective.quantile != pid->GetObjective().quantile
+		|| window.begin != pid->GetScoreWindow().begin || window.end != pid->GetScoreWindow().end
+		|| timing != pid->GetTiming() || cost_terms != pid->GetCostTerms())
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "The checkpoint is from a different training setup, starting a new training");
+		return false;
+	}
 
-			deltas[curparamidx] *= 1.1;
-			curparamidx = (curparamidx + 1) % 3;
-			execstart();
-		}
-		else
-		{
-			params[curparamidx] += deltas[curparamidx];
-			deltas[curparamidx] *= 0.9;
-			curparamidx = (curparamidx + 1) % 3;
-			execstart();
-		}
-		break;
-	default:
-		assert(false);
+	// a half restored optimizer would be unusable, so its current state is kept until the whole checkpoint is read
+	std::string current;
+	StateWriter backup(current);
+	optimizer->save(backup);
+
+	int _runs = 0;
+	double _best_err = 0, _best_params[3];
+	r.get(_runs);
+	r.get(_best_err);
+	r.get(_best_params);
+	optimizer->restore(r);
+	if (!r.ok() || !r.finished())
+	{
+		StateReader undo(current.data(), current.size());
+		optimizer->restore(undo);
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "The checkpoint is invalid, starting a new training");
+		return false;
 	}
-};
+	runs = _runs;
+	best_err = _best_err;
+	for (int i = 0; i < 3; i++)
+		best_params[i] = _best_params[i];
+	next_run();
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "RESUMED at run {} Best err: {} Params: {} {} {}", runs, best_err, best_params[0], best_params[1], best_params[2]);
+	LOG(LogChannel::CONSOLE, LogLevel::INFO, "Training resumed from the checkpoint at run {}", runs);
+	return true;
+}
 
 void PIDTRAINER::best_found(double err)
 {
@@ -198,14 +485,7 @@ void PIDTRAINER::best_found(double err)
 	best_params[0] = params[0];
 	best_params[1] = params[1];
 	best_params[2] = params[2];
-	best_deltas[0] = deltas[0];
-	best_deltas[1] = deltas[1];
-	best_deltas[2] = deltas[2];
 
-#ifdef USE_LOGGING
-	logfile << "NEW Best was born: " << best_err << " Params: " << best_params[0] << " " << best_params[1] << " " << best_params[2] << " " << best_deltas[0] << " " << best_deltas[1] << " " << best_deltas[2] << endl;
-	logfile.flush();
-#endif
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "NEW Best was born: {} Params: {} {} {}", best_err, best_params[0], best_params[1], best_params[2]);
 
 };
-
@@ -1,22 +1,93 @@
 #ifndef PID_H
 #define PID_H
+#include <math.h>
 #include <iostream>
-#include <fstream>
+#include <memory>
+#include <string>
+#include "optimizer.h"
+#include "stats.h"
 
-// If you want to use logging for PIDTRAINER, enable this
-//#define USE_LOGGING
+// The cost policies: the terms of the cost value of one sample, used by the PIDTRAINER.
+// They are combined with CostSum, and the PID controller is compiled with every combination ( @see PID::SetCostTerms() ),
+// so the terms which are not used are not calculated at all.
+struct CteCost {
+  static double cost(double cte, double speed, double angle) { return cte * cte; }
+};
+
+// Speed weight: the error magnitude and the speed value are inversely proportional
+struct SpeedWeightCost {
+  static double cost(double cte, double speed, double angle) { return 2000 * exp(-speed / 50.0); }
+};
+
+// Steering angle weight: a smoother control is preferred
+struct AngleWeightCost {
+  static double cost(double cte, double speed, double angle) { return 1000 * (1 - exp(-fabs(angle) / 25.0)); }
+};
+
+// The sum of cost terms, added from left to right
+template <typename... Terms>
+struct CostSum;
+
+template <>
+struct CostSum<> {
+  static double add(double sum, double cte, double speed, double angle) { return sum; }
+  static double cost(double cte, double speed, double angle) { return 0; }
+};
 
-// If you want to use PIDTRAINER, enable this
-//#define USE_TRAINING
+template <typename Term, typename... Rest>
+struct CostSum<Term, Rest...> {
+  static double add(double sum, double cte, double speed, double angle) {
+    return CostSum<Rest...>::add(sum + Term::cost(cte, speed, angle), cte, speed, angle);
+  }
+  static double cost(double cte, double speed, double angle) {
+    return CostSum<Rest...>::add(Term::cost(cte, speed, angle), cte, speed, angle);
+  }
+};
+
+// The runtime selection of the cost terms ( the CTE*CTE term is always used )
+enum CostTerms : unsigned {
+  COST_CTE = 0,
+  COST_SPEED = 1,               // SpeedWeightCost
+  COST_ANGLE = 2,               // AngleWeightCost
+  COST_TERMS_COUNT = 4,         // the number of combinations
+};
+
+// Parse a comma separated list of cost terms ( cte, speed, angle ). Returns false if a term is unknown.
+bool parse_cost_terms(const char* list, unsigned& terms);
 
-// To use Speed_weight with in the PIDTRAINER full sample error, uncomment this
-//#define USE_SPEED_WEIGHT
+// The rules to end a hopeless simulation run early in training mode, instead of driving all of its samples
+struct EarlyStopConfig {
+  double max_cte = 0;           // stop if |cte| is above this, e.g. the car left the track ( 0 = off )
+  bool cost_limit = false;      // stop if the accumulated cost is already above the cost of the best run ( set by the PIDTRAINER, twiddle only )
+  double min_speed = 0;         // stop if the speed is below this after the warm-up ( 0 = off )
+  int warmup = 200;             // the number of samples at the start of a run without the speed rule ( the car starts standing )
+};
+
+// The samples of a simulation run which are scored by the cost value in training mode ( the others are driven, but not scored ).
+// The window is the [begin, end) range of the sample numbers, a negative value counts from the end of the run.
+// E.g. begin = 200 skips the warm-up at the start, begin = -1000 scores the last 1000 samples only,
+// and a positive range scores a segment of the track ( the car is at about the same place at the same sample number in every run ).
+struct ScoreWindow {
+  int begin = 0;
+  int end = 0;                  // 0 = the end of the run
+};
 
-// To use Steering angle weight in the PIDTRAINER full sample error, uncomment this
-//#define USE_ANGLE_WEIGHT
+// The time step of the I and D terms of the PID controller
+enum class Timing {
+  SPEED,                        // 100 / speed per frame: proportional to the time of one frame at a constant frame rate ( no clock needed )
+  MEASURED,                     // the measured time between the updates, in seconds ( the receive times, or the step of the simulator )
+};
 
-using std::ofstream;
-using std::endl;
+// Parse a timing name ( speed or measured ). Returns false if it's unknown.
+bool parse_timing(const char* name, Timing& timing);
+
+// Why the current run was stopped early
+enum class StopReason {
+  NONE,
+  CTE,
+  COST,
+  SPEED,
+};
 
 class PID {
  public:
@@ -39,8 +110,46 @@ class PID {
   /**
    * Update the PID error variables given cross track error.
    * @param cte The current cross track error
+   * @param frames The number of the simulator frames since the previous update. It's more than 1 if the frames between were dropped,
+   *               then the elapsed time is that many times longer, and the integral is extended over the dropped frames.
+   * @param elapsed The measured time since the previous update in seconds, only used with Timing::MEASURED. If it's unknown ( 0 ),
+   *                or it's longer than MAX_MEASURED_DT ( a pause or a restart of the simulator ), the last valid one is used again.
+   */
+  void UpdateError(double cte, double speed, double angle, int frames = 1, double elapsed = 0) { (this->*update)(cte, speed, angle, frames, elapsed); }
+
+  /**
+   * Select the time step of the I and D terms. The coefficients are not interchangeable between the timings, they must be trained
+   * with the same one. It's kept by Init().
+   * @param _timing The timing ( SPEED by default )
    */
-  void UpdateError(double cte, double speed, double angle);
+  void SetTiming(Timing _timing);
+  Timing GetTiming() const { return timing; }
+
+  // The longest valid measured time step in seconds
+  static constexpr double MAX_MEASURED_DT = 1.0;
+
+  /**
+   * Select the terms of the cost value. The UpdateError() compiled with the combination of the terms is used from now on. It's kept by Init().
+   * @param terms The combination of the CostTerms flags
+   */
+  void SetCostTerms(unsigned terms);
+  unsigned GetCostTerms() const { return cost_terms; }
+
+  // The cost value of one sample with a combination of the CostTerms, for the users of the same cost outside of PID
+  typedef double (*SampleCost)(double cte, double speed, double angle);
+  static SampleCost CostFunction(unsigned terms);
+
+  /**
+   * Select the statistic of the per-sample cost values which is the cost value of a run. It's kept by Init().
+   * The objectives other than MEAN maintain the streaming statistics of the samples in UpdateError(), the MEAN doesn't pay for them.
+   * The cost_limit early stop rule is only used with MEAN, the other objectives have no lower bound during the run.
+   * @param _objective The objective
+   */
+  void SetObjective(const Objective& _objective);
+  const Objective& GetObjective() const { return objective; }
+
+  // The streaming statistics of the current run ( only maintained if the objective is not MEAN )
+  const RunStats& GetRunStats() const { return stats; }
 
   /**
    * Calculate the total PID error.
@@ -50,17 +159,47 @@ class PID {
 
   /**
    * Calculate the cost value on the whole simulation executed previously, with speed/steering_angle error(s) included if used.
-   * @param pt The PIDTRAINER. Only necessary because of the logfile's handle in it.
-   * @output The total cost value of this simulation run. This is the average of ( the sum of the squares of all track deviations (CTE*CTE) and speed/steering_angle error(s) if included ).
+   * @param pt The PIDTRAINER. If given, the average speed of the run ( and the statistics of the samples ) are written to the training log.
+   * @output The total cost value of this simulation run. By default this is the average of ( the sum of the squares of all track deviations (CTE*CTE) and speed/steering_angle error(s) if included ),
+   *         the objective selects another statistic of the same per-sample values ( @see SetObjective() ).
    */
   double GetCostValue(class PIDTRAINER* pt = nullptr);
 
   /**
    * Set length of one simulation run in training mode (with PIDTRAINER).
-   * @param _total_samplelen The length of one simulation run. (The UpdateError should be called this many times) It is only used if for example the second half of a simulation is used for cost value calculation.
+   * @param _total_samplelen The length of one simulation run. (The UpdateError should be called this many times) It is used to place the scoring window, and to score the early stopped runs.
    */
   void Set_Train_SampleLen(int _total_samplelen);
 
+  /**
+   * Set the samples of the runs which are scored by the cost value. It's kept by Init().
+   * @param window The scored range of the samples ( the whole run by default )
+   */
+  void SetScoreWindow(const ScoreWindow& window);
+  const ScoreWindow& GetScoreWindow() const { return score_window; }
+
+  /**
+   * Set the early stop rules, checked in every UpdateError(). They are kept by Init().
+   * @param _early_stop The rules
+   */
+  void SetEarlyStop(const EarlyStopConfig& _early_stop);
+
+  /**
+   * Set the cost of the best run so far, for the cost_limit rule. ( 0 = no limit ) It's kept by Init().
+   * @param best_err The best cost value, a run is stopped when its accumulated cost can't be lower than this anymore
+   */
+  void SetCostLimit(double best_err);
+
+  // Why the current run was stopped early ( NONE if it was not ). A stopped run must be ended and scored by the caller.
+  StopReason GetStopReason() const { return stop_reason; }
+
+  /**
+   * The P, I and D components of the last TotalError(), for recording and analysis
+   */
+  double GetPError() const { return p_error; }
+  double GetIError() const { return i_error; }
+  double GetDError() const { return d_error; }
+
   int samplenum;				// the number of the current iteration (starts from 0, increased on each PID controller usage)
 
  private:
@@ -70,8 +209,19 @@ class PID {
   double p_error;
   double i_error;
   double d_error;
-  double spd_error;
-  double angle_error;
+
+  // UpdateError() with a cost policy, with or without the streaming statistics, with the speed or the measured timing,
+  // and the one selected by SetCostTerms(), SetObjective() and SetTiming()
+  template <typename CostPolicy, bool STATS, bool MEASURED>
+  void UpdateErrorWith(double cte, double speed, double angle, int frames, double elapsed);
+  typedef void (PID::*UpdateFunction)(double cte, double speed, double angle, int frames, double elapsed);
+  template <bool STATS, bool MEASURED>
+  static UpdateFunction UpdateFor(unsigned terms);
+  UpdateFunction update;
+  void SelectUpdate();
+  unsigned cost_terms;
+  Timing timing;
+  double last_dt;               // the last valid measured time step ( 0 = none yet )
 
   /**
    * PID Coefficients
@@ -87,55 +237,112 @@ class PID {
   double total_cte_err;			// the accumulated error values used for cost value
   int total_cte_len;			// The count of the items summarized in total_cte_err.  ( at the end, total_cte_err/total_cte_err will be the average cost value )
   int total_samplelen;			// The length of one simulation run (UpdateError will be called this many times)
+
+  // The scoring window, resolved to the sample numbers of the run
+  void ResolveScoreWindow();
+  ScoreWindow score_window;
+  int score_begin;
+  int score_end;
+  int score_len;				// the number of the scored samples in a complete run
+
+  // Early stop
+  void CheckEarlyStop(double cte, double speed);
+  EarlyStopConfig early_stop;
+  bool early_stop_active;		// any of the rules is on
+  double cost_limit;			// the accumulated cost above which the run can't be the best anymore ( 0 = no limit )
+  bool cost_limit_active;		// the cost_limit rule is on, and usable with the objective
+  double max_cte2;				// the largest cte*cte of the run
+  StopReason stop_reason;
+
+  // The cost value statistic
+  Objective objective;
+  RunStats stats;
+  // GetCostValue() with an objective other than MEAN
+  double GetObjectiveValue(class PIDTRAINER* pt) const;
 };
 
 // PIDTRAINER class: 
 //   This class implements a PID hyperparameter trainer.
-//   It requires an initial P,I,and D parameter, and 3 delta values to be used in the twiddle algorithm. (@see notes.md)
+//   It drives an Optimizer ( twiddle by default ) with the cost values of the simulation runs. (@see notes.md)
 //	 It can be used by calling its ready() method after a simulation run is over. 
 class PIDTRAINER {
 
 public:
-	ofstream logfile;
 	PID* pid;					// the PID controller to train
+	std::unique_ptr<Optimizer> optimizer;
 
-	// the current parameters and deltas
+	// the parameters of the current simulation run
 	double params[3];
-	double deltas[3];
 
-	// the lowest cost value, parameters and deltas
+	// the lowest cost value, and its parameters
 	double best_err;
-	double best_deltas[3];
 	double best_params[3];
 	
 	// simulation run length
 	int target_samplenum;
 
-	// States used in the twiddle algorithm
-	enum {
-		START,
-		PARAMINCREASED,
-		PARAMDECREASED,
-	} curstate;
-	
-	// The index of the parameter to be used currently in the twiddle algorithm
-	int curparamidx;
+	// the number of finished simulation runs, and the number of the discarded, unfinished ones
+	int runs;
+	int aborted_runs;
+
+	// if not empty, the state of the training is saved into this file after every run
+	std::string checkpoint_path;
+
+	// the rules to stop hopeless runs early
+	EarlyStopConfig early_stop;
 
 	/**
-	* Construct the PID trainer
+	* Construct the PID trainer with the twiddle algorithm
 	* @param _pid The PID controller to train
 	* @param _target_samplenum The length of one simulation run
 	* @param _p,_i,_d,d1,d2,d3 The initial PID coefficients with delta values used in the twiddle algorithm
 	*/	
 	PIDTRAINER(PID* _pid, int _target_samplenum, double _p, double _i, double _d, double d1, double d2, double d3);
+
+	/**
+	* Construct the PID trainer with any optimizer
+	* @param _pid The PID controller to train, it's initialized with the first parameters of the optimizer
+	* @param _target_samplenum The length of one simulation run
+	* @param _optimizer The optimization algorithm
+	*/
+	PIDTRAINER(PID* _pid, int _target_samplenum, std::unique_ptr<Optimizer> _optimizer);
 	
 	~PIDTRAINER();
 
-	// This method implements the asynchronous twiddle algorithm
+	// Evaluate the simulation run just finished, and initialize the PID controller with the next parameters of the optimizer
 	// It must be called every time when a simulation run is finished
 	void ready();
 
+	/**
+	* Resume the training from a checkpoint file if it exists, and save the checkpoints into it after every run from now on.
+	* The checkpoint is only used if it was saved by the same optimizer algorithm with the same run length, objective, scoring window, timing and cost terms.
+	* Only one trainer of the process can use a checkpoint file at a time ( @see claim_checkpoint() ), the others are not checkpointed.
+	* @param path The checkpoint file
+	* @output true if the training was resumed from the checkpoint
+	*/
+	bool set_checkpoint(const char* path);
+
+	// Set the early stop rules of the runs
+	void set_early_stop(const EarlyStopConfig& _early_stop);
+
+	// Discard the current, unfinished simulation run ( e.g. when the simulator stopped responding ).
+	// The PID controller is restarted with the same parameters, so the run is repeated, and the optimizer does not see the partial run.
+	void abort_run();
+
+	/**
+	* Continue the training with another PID controller ( of a new session, when the simulator reconnected ).
+	* The previous controller is not used anymore ( it may be deleted already ), the new one is initialized with the parameters of the current run.
+	* @param _pid The PID controller to train from now on
+	*/
+	void attach(PID* _pid);
+
 private:
+	// Save the state of the trainer and its optimizer into the checkpoint file
+	void save_checkpoint() const;
+
+	// Start the next run with the next parameters of the optimizer
+	void next_run();
+
 	// This internal method will be called when new best hyperparameters are found by the algorithm (called from the ready() method)
 	void best_found(double err);
 };
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "simulator.h"
+#include "pid_batch.h"
+#include "session.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "logger.h"
+
+// pid_bench: microbenchmarks of the stages of the control path, on canned telemetry frames.
+//   pid_bench [--filter=TEXT] [--min-time=S] [--check]
+//     --filter		Run only the benchmarks whose name contains this text
+//     --min-time		The minimum measured time of one benchmark in seconds ( 0.5 by default )
+//     --check			Only check that PIDBatch gives the same outputs and cost values as the scalar PID, the exit code is 1 if not.
+//					The check is also done before the benchmarks.
+//   Every benchmark is repeated with more and more iterations until it runs for at least the minimum time, then its time and
+//   the number of the memory allocations per operation are printed. The control path should not allocate any memory at all.
+//   The canned frames are a run of the headless simulator ( VehicleSim ), formatted like the messages of the Unity simulator.
+
+// The memory allocations of the benchmark thread ( the background thread of the logger is not counted )
+static thread_local uint64_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+// Keep the compiler from optimizing away the calculation of a value which is not used otherwise
+template <typename T>
+inline void do_not_optimize(const T& value)
+{
+#if defined(__GNUC__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile char sink;
+	sink = *reinterpret_cast<const volatile char*>(&value);
+#endif
+}
+
+// BenchState class:
+//   The loop of a benchmark: the set up is done before the loop, and only the iterations of while (state.keep_running()) are measured.
+class BenchState {
+
+public:
+	explicit BenchState(uint64_t _iterations) : iterations(_iterations), remaining(_iterations), started(false), elapsed_ns(0), allocs(0) {}
+
+	bool keep_running() {
+		if (!started)
+		{
+			started = true;
+			start_allocs = allocations;
+			start_ns = monotonic_ns();
+		}
+		if (remaining == 0)
+		{
+			elapsed_ns = monotonic_ns() - start_ns;
+			allocs = allocations - start_allocs;
+			return false;
+		}
+		remaining--;
+		return true;
+	}
+
+	const uint64_t iterations;
+
+	// The measured time and the memory allocations of the loop
+	uint64_t elapsed() const { return elapsed_ns; }
+	uint64_t allocated() const { return allocs; }
+
+private:
+	uint64_t remaining;
+	bool started;
+	uint64_t start_ns;
+	uint64_t start_allocs;
+	uint64_t elapsed_ns;
+	uint64_t allocs;
+};
+
+// The canned input of the benchmarks
+struct Frames {
+	std::vector<Telemetry> telemetry;
+	std::vector<std::string> messages;	// the telemetry as the simulator sends it
+	std::vector<double> steer;			// the control values of the frames, for formatting the replies
+	std::vector<double> throttle;
+};
+
+static Frames make_frames()
+{
+	Frames frames;
+	Track track = Track::default_track();
+	VehicleSim sim(track);
+	SessionConfig config;
+	Session session(config);
+	ReplyWriter writer;
+	for (int i = 0; i < 4500; i++)
+	{
+		Telemetry t = sim.telemetry();
+		double steer_value, throttle;
+		logic(session.pid, session.pid_throttle, session.optimal_speed, t.cte, t.speed, t.angle, steer_value, throttle);
+		frames.telemetry.push_back(t);
+		writer.telemetry(t);
+		frames.messages.push_back(std::string(writer.data(), writer.length()));
+		frames.steer.push_back(steer_value);
+		frames.throttle.push_back(throttle);
+		sim.step(steer_value, throttle);
+	}
+	return frames;
+}
+
+static const Frames& frames()
+{
+	static const Frames canned = make_frames();
+	return canned;
+}
+
+// The benchmarks
+
+// the decoding of the incoming messages ( it replaced the hasData() / JSON parsing of the original application )
+static void bench_decode_telemetry(BenchState& state)
+{
+	const std::vector<std::string>& messages = frames().messages;
+	size_t i = 0;
+	Telemetry t;
+	while (state.keep_running())
+	{
+		const std::string& m = messages[i];
+		MessageKind kind = decode_message(m.data(), m.size(), t);
+		do_not_optimize(kind);
+		do_not_optimize(t);
+		if (++i == messages.size())
+			i = 0;
+	}
+}
+
+static void bench_decode_manual(BenchState& state)
+{
+	ReplyWriter writer;
+	writer.manual();
+	Telemetry t;
+	while (state.keep_running())
+	{
+		MessageKind kind = decode_message(writer.data(), writer.length(), t);
+		do_not_optimize(kind);
+	}
+}
+
+static void bench_update_error(BenchState& state)
+{
+	const std::vector<Telemetry>& telemetry = frames().telemetry;
+	PID pid;
+	pid.Init(0.479685, 0.00026508, 4.97478);
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		const Telemetry& t = telemetry[i];
+		pid.UpdateError(t.cte, t.speed, t.angle);
+		do_not_optimize(pid);
+		if (++i == telemetry.size())
+			i = 0;
+	}
+}
+
+static void bench_total_error(BenchState& state)
+{
+	PID pid;
+	pid.Init(0.479685, 0.00026508, 4.97478);
+	pid.UpdateError(0.7598, 0.438, 0);
+	while (state.keep_running())
+	{
+		double steer_value = pid.TotalError();
+		do_not_optimize(steer_value);
+	}
+}
+
+// The gain sets of the PIDBatch benchmarks and the check: a grid around the default gains
+static const int BATCH_SIZE = 256;
+
+static void batch_gains(std::vector<double>& kp, std::vector<double>& ki, std::vector<double>& kd)
+{
+	kp.clear(); ki.clear(); kd.clear();
+	for (int l = 0; l < BATCH_SIZE; l++)
+	{
+		kp.push_back(0.479685 * (0.5 + (l % 8) / 7.0));
+		ki.push_back(0.00026508 * (0.5 + (l / 8 % 4) / 3.0));
+		kd.push_back(4.97478 * (0.5 + (l / 32) / 7.0));
+	}
+}
+
+// one sample of BATCH_SIZE gain sets, with PIDBatch and with the scalar PID
+static void bench_batch(BenchState& state)
+{
+	const std::vector<Telemetry>& telemetry = frames().telemetry;
+	std::vector<double> kp, ki, kd;
+	batch_gains(kp, ki, kd);
+	PIDBatch batch;
+	batch.Init(kp.data(), ki.data(), kd.data(), BATCH_SIZE);
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		const Telemetry& t = telemetry[i];
+		batch.UpdateError(t.cte, t.speed, t.angle);
+		const double* out = batch.TotalError();
+		do_not_optimize(out[0]);
+		if (++i == telemetry.size())
+			i = 0;
+	}
+}
+
+static void bench_batch_scalar(BenchState& state)
+{
+	const std::vector<Telemetry>& telemetry = frames().telemetry;
+	std::vector<double> kp, ki, kd;
+	batch_gains(kp, ki, kd);
+	std::vector<PID> pids(BATCH_SIZE);
+	for (int l = 0; l < BATCH_SIZE; l++)
+		pids[l].Init(kp[l], ki[l], kd[l]);
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		const Telemetry& t = telemetry[i];
+		for (PID& pid : pids)
+		{
+			pid.UpdateError(t.cte, t.speed, t.angle);
+			double out = pid.TotalError();
+			do_not_optimize(out);
+		}
+		if (++i == telemetry.size())
+			i = 0;
+	}
+}
+
+// Check that PIDBatch gives bit-identical outputs and cost values to the scalar PID, on the canned frames and with every cost term.
+// A lane has zero gains, and a few frames have zero CTE, as the sign of the zero outputs must be the same too.
+static bool check_batch()
+{
+	std::vector<Telemetry> telemetry = frames().telemetry;
+	for (size_t i : { size_t(0), size_t(1), telemetry.size() / 2, telemetry.size() / 2 + 1, telemetry.size() / 2 + 2 })
+		telemetry[i].cte = 0;
+	std::vector<double> kp, ki, kd;
+	batch_gains(kp, ki, kd);
+	kp[0] = ki[0] = kd[0] = 0;
+	uint64_t mismatches = 0;
+	for (unsigned terms = 0; terms < COST_TERMS_COUNT; terms++)
+	{
+		PIDBatch batch;
+		batch.SetCostTerms(terms);
+		batch.Init(kp.data(), ki.data(), kd.data(), BATCH_SIZE);
+		std::vector<PID> pids(BATCH_SIZE);
+		for (int l = 0; l < BATCH_SIZE; l++)
+		{
+			pids[l].SetCostTerms(terms);
+			pids[l].Init(kp[l], ki[l], kd[l]);
+		}
+		for (const Telemetry& t : telemetry)
+		{
+			batch.UpdateError(t.cte, t.speed, t.angle);
+			const double* out = batch.TotalError();
+			for (int l = 0; l < BATCH_SIZE; l++)
+			{
+				pids[l].UpdateError(t.cte, t.speed, t.angle);
+				double expected = pids[l].TotalError();
+				if (memcmp(&expected, &out[l], sizeof(double)) != 0)
+					mismatches++;
+			}
+		}
+		// the cost value depends only on the samples, not on the gains, so it's the same for all the lanes
+		double expected = pids[0].GetCostValue();
+		double cost = batch.GetCostValue();
+		if (memcmp(&expected, &cost, sizeof(double)) != 0)
+			mismatches++;
+	}
+	if (mismatches)
+		printf("***ERROR*** PIDBatch ( %s ) differs from PID in %llu values\n", PIDBatch::Isa(), (unsigned long long)mismatches);
+	return mismatches == 0;
+}
+
+static void bench_logic(BenchState& state)
+{
+	const std::vector<Telemetry>& telemetry = frames().telemetry;
+	SessionConfig config;
+	Session session(config);
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		const Telemetry& t = telemetry[i];
+		double steer_value, throttle;
+		logic(session.pid, session.pid_throttle, session.optimal_speed, t.cte, t.speed, t.angle, steer_value, throttle);
+		do_not_optimize(steer_value);
+		do_not_optimize(throttle);
+		if (++i == telemetry.size())
+			i = 0;
+	}
+}
+
+static void bench_reply_steer(BenchState& state)
+{
+	const std::vector<double>& steer = frames().steer;
+	const std::vector<double>& throttle = frames().throttle;
+	ReplyWriter writer;
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		size_t length = writer.steer(steer[i], throttle[i]);
+		do_not_optimize(length);
+		if (++i == steer.size())
+			i = 0;
+	}
+}
+
+// the whole control path of one message: decoding, the controllers and formatting the reply
+static void process_messages(BenchState& state, const SessionConfig& config)
+{
+	const std::vector<std::string>& messages = frames().messages;
+	Session session(config);
+	size_t i = 0;
+	while (state.keep_running())
+	{
+		const std::string& m = messages[i];
+		size_t length = process_message(m.data(), m.size(), session);
+		do_not_optimize(length);
+		if (++i == messages.size())
+			i = 0;
+	}
+}
+
+static void bench_process_message(BenchState& state)
+{
+	SessionConfig config;
+	process_messages(state, config);
+}
+
+// in training mode, including the optimizer step and the reset after every run
+static void bench_process_message_training(BenchState& state)
+{
+	SessionConfig config;
+	config.training = true;
+	config.optimal_speed = 50;
+	process_messages(state, config);
+}
+
+struct Benchmark {
+	const char* name;
+	void (*run)(BenchState& state);
+};
+
+static const Benchmark benchmarks[] = {
+	{ "decode_message/telemetry", bench_decode_telemetry },
+	{ "decode_message/manual", bench_decode_manual },
+	{ "PID::UpdateError", bench_update_error },
+	{ "PID::TotalError", bench_total_error },
+	{ "PIDBatch/256", bench_batch },
+	{ "PID/256", bench_batch_scalar },
+	{ "logic", bench_logic },
+	{ "ReplyWriter::steer", bench_reply_steer },
+	{ "process_message", bench_process_message },
+	{ "process_message/training", bench_process_message_training },
+};
+
+// Run a benchmark with more and more iterations, until it takes at least min_time seconds
+static BenchState measure(const Benchmark& b, double min_time)
+{
+	uint64_t iterations = 1;
+	for (;;)
+	{
+		BenchState state(iterations);
+		b.run(state);
+		double seconds = state.elapsed() * 1e-9;
+		if (seconds >= min_time || iterations >= (uint64_t(1) << 40))
+			return state;
+		// aim a little above the minimum time, but grow by at most 10x at once, as the short runs are inaccurate
+		double multiplier = seconds > 0 ? min_time * 1.4 / seconds : 10;
+		if (multiplier > 10)
+			multiplier = 10;
+		uint64_t next = uint64_t(iterations * multiplier);
+		iterations = next > iterations ? next : iterations + 1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char* filter = "";
+	double min_time = 0.5;
+	bool check_only = false;
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (strncmp(arg, "--filter=", 9) == 0)
+			filter = arg + 9;
+		else if (strncmp(arg, "--min-time=", 11) == 0)
+			min_time = atof(arg + 11);
+		else if (strcmp(arg, "--check") == 0)
+			check_only = true;
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return -1;
+		}
+	}
+	// the training runs would print their results
+	Logger::instance().set_level(LogChannel::CONSOLE, LogLevel::ERROR);
+
+#ifndef __OPTIMIZE__
+	printf("***WARNING*** pid_bench was compiled without optimization, the timings are not representative\n");
+#endif
+	frames();
+	if (!check_batch())
+		return 1;
+	printf("PIDBatch matches PID ( instruction set: %s )\n", PIDBatch::Isa());
+	if (check_only)
+		return 0;
+	printf("%-28s %12s %14s %12s\n", "Benchmark", "Time", "Iterations", "Allocs/op");
+	for (const Benchmark& b : benchmarks)
+	{
+		if (!strstr(b.name, filter))
+			continue;
+		BenchState state = measure(b, min_time);
+		printf("%-28s %9.2f ns %14llu %12.3f\n", b.name, double(state.elapsed()) / state.iterations,
+			(unsigned long long)state.iterations, double(state.allocated()) / state.iterations);
+	}
+	return 0;
+}
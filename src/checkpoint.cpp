@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "checkpoint.h"
+
+#ifndef _WIN32
+	#include <unistd.h>
+#else
+	#include <windows.h>
+#endif
+
+static const char CHECKPOINT_MAGIC[8] = { 'P', 'I', 'D', 'C', 'K', 'P', 'N', 'T' };
+static const uint32_t CHECKPOINT_VERSION = 5;		// 2: the objective of the training, 3: the scoring window, 4: the timing, 5: the cost terms
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t checksum;			// FNV-1a of the data
+	uint64_t length;			// the length of the data after the header
+};
+
+static uint32_t fnv1a(const std::string& data)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned char c : data)
+	{
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// The temporary file of a checkpoint, unique for the process and the thread, so concurrent writers never share one
+static std::string temp_path(const char* path)
+{
+#ifndef _WIN32
+	unsigned long pid = (unsigned long)getpid();
+#else
+	unsigned long pid = (unsigned long)GetCurrentProcessId();
+#endif
+	size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+	return std::string(path) + "." + std::to_string(pid) + "." + std::to_string(thread) + ".tmp";
+}
+
+bool write_checkpoint(const char* path, const std::string& data)
+{
+	std::string tmp = temp_path(path);
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+	CheckpointHeader header;
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.checksum = fnv1a(data);
+	header.length = data.size();
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(data.data(), 1, data.size(), f) == data.size()
+		&& fflush(f) == 0;
+#ifndef _WIN32
+	// the data must be on the disk before the rename, otherwise a crash could leave an empty file behind
+	ok = ok && fsync(fileno(f)) == 0;
+#endif
+	ok = (fclose(f) == 0) && ok;
+	if (ok)
+	{
+#ifndef _WIN32
+		ok = rename(tmp.c_str(), path) == 0;
+#else
+		ok = MoveFileExA(tmp.c_str(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#endif
+	}
+	if (!ok)
+		remove(tmp.c_str());
+	return ok;
+}
+
+bool read_checkpoint(const char* path, std::string& data)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return false;
+	CheckpointHeader header;
+	bool ok = fread(&header, sizeof(header), 1, f) == 1
+		&& memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0
+		&& header.version == CHECKPOINT_VERSION
+		&& header.length < (1u << 20);
+	if (ok)
+	{
+		data.resize(size_t(header.length));
+		ok = fread(&data[0], 1, data.size(), f) == data.size() && fnv1a(data) == header.checksum;
+	}
+	fclose(f);
+	return ok;
+}
+
+// the checkpoint files reserved by the trainers of the process
+static std::mutex claimed_lock;
+static std::set<std::string> claimed;
+
+bool claim_checkpoint(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(claimed_lock);
+	return claimed.insert(path).second;
+}
+
+void release_checkpoint(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(claimed_lock);
+	claimed.erase(path);
+}
@@ -0,0 +1,88 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+
+// StateWriter class:
+//   Appends plain data values ( numbers, enums, arrays of them ) to a binary state block, in their in-memory representation.
+//   The block is only read back by the same build on the same machine, so there's no byte order or padding conversion.
+class StateWriter {
+
+public:
+	explicit StateWriter(std::string& _out) : out(_out) {}
+
+	template <typename T>
+	void put(const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be stored");
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+private:
+	std::string& out;
+};
+
+// StateReader class:
+//   Reads the values of a state block in the order they were written by a StateWriter.
+//   If the block is too short, the values are left unchanged and ok() returns false.
+class StateReader {
+
+public:
+	StateReader(const char* _data, size_t _length) : data(_data), length(_length), pos(0), failed(false) {}
+
+	template <typename T>
+	void get(T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be read");
+		if (failed || length - pos < sizeof(T))
+		{
+			failed = true;
+			return;
+		}
+		memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+	}
+
+	// false if a value could not be read
+	bool ok() const { return !failed; }
+	// true if all the bytes of the block were read
+	bool finished() const { return pos == length; }
+
+private:
+	const char* data;
+	size_t length;
+	size_t pos;
+	bool failed;
+};
+
+/**
+* Write a checkpoint file atomically: the data is written to <path>.<pid>.<thread>.tmp, flushed to the disk, and renamed to path.
+* So the file at path is always either the previous or the new complete checkpoint, even if the process is killed.
+* The data is prefixed with a header ( magic, version, length, checksum ).
+* @param path The checkpoint file
+* @param data The content
+* @output false if the file could not be written ( the previous checkpoint is kept then )
+*/
+bool write_checkpoint(const char* path, const std::string& data);
+
+/**
+* Read a checkpoint file written by write_checkpoint()
+* @param path The checkpoint file
+* @param data The content is written here
+* @output false if the file does not exist, or it's not a valid checkpoint ( wrong header, length or checksum )
+*/
+bool read_checkpoint(const char* path, std::string& data);
+
+/**
+* Reserve a checkpoint file for one trainer of the process. The trainers of concurrent sessions would overwrite each other's
+* checkpoints in the same file, so only the first one may use it, until it releases it.
+* @param path The checkpoint file
+* @output false if it's already reserved
+*/
+bool claim_checkpoint(const std::string& path);
+
+// Release a checkpoint file reserved by claim_checkpoint()
+void release_checkpoint(const std::string& path);
+
+#endif  // CHECKPOINT_H
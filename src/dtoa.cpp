@@ -0,0 +1,336 @@
+#include <stdint.h>
+#include <string.h>
+#include "dtoa.h"
+
+// Grisu2, after the paper of Florian Loitsch and its reference implementation.
+// The value is scaled by a cached power of ten into a 64 bit "do-it-yourself" floating point number, with its rounding boundaries,
+// and the digits are generated from the integer and fractional parts of the scaled upper boundary, until the result is inside
+// the boundaries ( so it reads back as the same double ).
+
+namespace {
+
+// A floating point number f * 2^e, with a 64 bit significand
+struct DiyFp {
+	uint64_t f;
+	int e;
+};
+
+DiyFp sub(const DiyFp& x, const DiyFp& y)
+{
+	return DiyFp{ x.f - y.f, x.e };
+}
+
+// The product, rounded to 64 bits
+DiyFp mul(const DiyFp& x, const DiyFp& y)
+{
+	const uint64_t M32 = 0xFFFFFFFFu;
+	uint64_t a = x.f >> 32, b = x.f & M32;
+	uint64_t c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t mid = (bd >> 32) + (ad & M32) + (bc & M32) + (uint64_t(1) << 31);
+	return DiyFp{ ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+}
+
+DiyFp normalize(DiyFp x)
+{
+	while ((x.f >> 63) == 0)
+	{
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+// The value v ( > 0 ), and the halfway points to its neighbours, normalized to the same exponent as the upper one
+struct Boundaries {
+	DiyFp w;
+	DiyFp minus;
+	DiyFp plus;
+};
+
+Boundaries boundaries(double v)
+{
+	const int SIGNIFICAND_BITS = 52;
+	const uint64_t HIDDEN_BIT = uint64_t(1) << SIGNIFICAND_BITS;
+	const int EXPONENT_BIAS = 1023 + SIGNIFICAND_BITS;
+
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	uint64_t F = bits & (HIDDEN_BIT - 1);
+	int E = int((bits >> SIGNIFICAND_BITS) & 0x7FF);
+
+	DiyFp x = E == 0 ? DiyFp{ F, 1 - EXPONENT_BIAS } : DiyFp{ F + HIDDEN_BIT, E - EXPONENT_BIAS };
+	// the lower neighbour is closer if v is a power of 2 ( except the smallest normal value )
+	bool lower_closer = F == 0 && E > 1;
+	DiyFp plus = normalize(DiyFp{ 2 * x.f + 1, x.e - 1 });
+	DiyFp minus = lower_closer ? DiyFp{ 4 * x.f - 1, x.e - 2 } : DiyFp{ 2 * x.f - 1, x.e - 1 };
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+	return Boundaries{ normalize(x), minus, plus };
+}
+
+// The normalized approximations of 10^k, for every 8th k from -300 to 324
+struct CachedPower {
+	uint64_t f;
+	int e;
+	int k;
+};
+
+const CachedPower CACHED_POWERS[] = {
+	{ 0xAB70FE17C79AC6CA, -1060, -300 },
+	{ 0xFF77B1FCBEBCDC4F, -1034, -292 },
+	{ 0xBE5691EF416BD60C, -1007, -284 },
+	{ 0x8DD01FAD907FFC3C,  -980, -276 },
+	{ 0xD3515C2831559A83,  -954, -268 },
+	{ 0x9D71AC8FADA6C9B5,  -927, -260 },
+	{ 0xEA9C227723EE8BCB,  -901, -252 },
+	{ 0xAECC49914078536D,  -874, -244 },
+	{ 0x823C12795DB6CE57,  -847, -236 },
+	{ 0xC21094364DFB5637,  -821, -228 },
+	{ 0x9096EA6F3848984F,  -794, -220 },
+	{ 0xD77485CB25823AC7,  -768, -212 },
+	{ 0xA086CFCD97BF97F4,  -741, -204 },
+	{ 0xEF340A98172AACE5,  -715, -196 },
+	{ 0xB23867FB2A35B28E,  -688, -188 },
+	{ 0x84C8D4DFD2C63F3B,  -661, -180 },
+	{ 0xC5DD44271AD3CDBA,  -635, -172 },
+	{ 0x936B9FCEBB25C996,  -608, -164 },
+	{ 0xDBAC6C247D62A584,  -582, -156 },
+	{ 0xA3AB66580D5FDAF6,  -555, -148 },
+	{ 0xF3E2F893DEC3F126,  -529, -140 },
+	{ 0xB5B5ADA8AAFF80B8,  -502, -132 },
+	{ 0x87625F056C7C4A8B,  -475, -124 },
+	{ 0xC9BCFF6034C13053,  -449, -116 },
+	{ 0x964E858C91BA2655,  -422, -108 },
+	{ 0xDFF9772470297EBD,  -396, -100 },
+	{ 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+	{ 0xF8A95FCF88747D94,  -343,  -84 },
+	{ 0xB94470938FA89BCF,  -316,  -76 },
+	{ 0x8A08F0F8BF0F156B,  -289,  -68 },
+	{ 0xCDB02555653131B6,  -263,  -60 },
+	{ 0x993FE2C6D07B7FAC,  -236,  -52 },
+	{ 0xE45C10C42A2B3B06,  -210,  -44 },
+	{ 0xAA242499697392D3,  -183,  -36 },
+	{ 0xFD87B5F28300CA0E,  -157,  -28 },
+	{ 0xBCE5086492111AEB,  -130,  -20 },
+	{ 0x8CBCCC096F5088CC,  -103,  -12 },
+	{ 0xD1B71758E219652C,   -77,   -4 },
+	{ 0x9C40000000000000,   -50,    4 },
+	{ 0xE8D4A51000000000,   -24,   12 },
+	{ 0xAD78EBC5AC620000,     3,   20 },
+	{ 0x813F3978F8940984,    30,   28 },
+	{ 0xC097CE7BC90715B3,    56,   36 },
+	{ 0x8F7E32CE7BEA5C70,    83,   44 },
+	{ 0xD5D238A4ABE98068,   109,   52 },
+	{ 0x9F4F2726179A2245,   136,   60 },
+	{ 0xED63A231D4C4FB27,   162,   68 },
+	{ 0xB0DE65388CC8ADA8,   189,   76 },
+	{ 0x83C7088E1AAB65DB,   216,   84 },
+	{ 0xC45D1DF942711D9A,   242,   92 },
+	{ 0x924D692CA61BE758,   269,  100 },
+	{ 0xDA01EE641A708DEA,   295,  108 },
+	{ 0xA26DA3999AEF774A,   322,  116 },
+	{ 0xF209787BB47D6B85,   348,  124 },
+	{ 0xB454E4A179DD1877,   375,  132 },
+	{ 0x865B86925B9BC5C2,   402,  140 },
+	{ 0xC83553C5C8965D3D,   428,  148 },
+	{ 0x952AB45CFA97A0B3,   455,  156 },
+	{ 0xDE469FBD99A05FE3,   481,  164 },
+	{ 0xA59BC234DB398C25,   508,  172 },
+	{ 0xF6C69A72A3989F5C,   534,  180 },
+	{ 0xB7DCBF5354E9BECE,   561,  188 },
+	{ 0x88FCF317F22241E2,   588,  196 },
+	{ 0xCC20CE9BD35C78A5,   614,  204 },
+	{ 0x98165AF37B2153DF,   641,  212 },
+	{ 0xE2A0B5DC971F303A,   667,  220 },
+	{ 0xA8D9D1535CE3B396,   694,  228 },
+	{ 0xFB9B7CD9A4A7443C,   720,  236 },
+	{ 0xBB764C4CA7A44410,   747,  244 },
+	{ 0x8BAB8EEFB6409C1A,   774,  252 },
+	{ 0xD01FEF10A657842C,   800,  260 },
+	{ 0x9B10A4E5E9913129,   827,  268 },
+	{ 0xE7109BFBA19C0C9D,   853,  276 },
+	{ 0xAC2820D9623BF429,   880,  284 },
+	{ 0x80444B5E7AA7CF85,   907,  292 },
+	{ 0xBF21E44003ACDD2D,   933,  300 },
+	{ 0x8E679C2F5E44FF8F,   960,  308 },
+	{ 0xD433179D9C8CB841,   986,  316 },
+	{ 0x9E19DB92B4E31BA9,  1013,  324 },
+};
+
+// The range of the binary exponent of the scaled values, so the integer part fits into 32 bits
+const int ALPHA = -60;
+const int GAMMA = -32;
+
+// A cached power c, so the exponent of e * c is in [ALPHA, GAMMA]
+const CachedPower& cached_power(int e)
+{
+	const int MIN_DEC_EXP = -300;
+	const int DEC_STEP = 8;
+	int f = ALPHA - e - 1;
+	int k = (f * 78913) / (1 << 18) + (f > 0);			// ceil(f * log10(2))
+	int index = (-MIN_DEC_EXP + k + (DEC_STEP - 1)) / DEC_STEP;
+	return CACHED_POWERS[index];
+}
+
+// The number of the decimal digits of n ( > 0 ), and the largest power of ten which is not above it
+int largest_pow10(uint32_t n, uint32_t& pow10)
+{
+	static const uint32_t POW10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	int digits = 10;
+	while (digits > 1 && n < POW10[digits - 1])
+		digits--;
+	pow10 = POW10[digits - 1];
+	return digits;
+}
+
+// Move the last digit closer to the exact value, while it stays inside the boundaries
+void round_last(char* buf, int len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k)
+{
+	while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist))
+	{
+		buf[len - 1]--;
+		rest += ten_k;
+	}
+}
+
+// Generate the shortest digits of the scaled value w in ( minus, plus ), value = digits * 10^exponent
+int generate_digits(char* buf, int& exponent, const DiyFp& minus, const DiyFp& w, const DiyFp& plus)
+{
+	uint64_t delta = sub(plus, minus).f;
+	uint64_t dist = sub(plus, w).f;
+	const int shift = -plus.e;
+	const uint64_t one = uint64_t(1) << shift;
+
+	uint32_t p1 = uint32_t(plus.f >> shift);			// the integer part
+	uint64_t p2 = plus.f & (one - 1);					// the fractional part
+	int len = 0;
+
+	uint32_t pow10;
+	int n = largest_pow10(p1, pow10);
+	while (n > 0)
+	{
+		buf[len++] = char('0' + p1 / pow10);
+		p1 %= pow10;
+		n--;
+		uint64_t rest = (uint64_t(p1) << shift) + p2;
+		if (rest <= delta)
+		{
+			exponent += n;
+			round_last(buf, len, dist, delta, rest, uint64_t(pow10) << shift);
+			return len;
+		}
+		pow10 /= 10;
+	}
+
+	int m = 0;
+	for (;;)
+	{
+		p2 *= 10;
+		buf[len++] = char('0' + (p2 >> shift));
+		p2 &= one - 1;
+		m++;
+		delta *= 10;
+		dist *= 10;
+		if (p2 <= delta)
+			break;
+	}
+	exponent -= m;
+	round_last(buf, len, dist, delta, p2, one);
+	return len;
+}
+
+// The shortest digits of v ( > 0 ), value = digits * 10^exponent
+int grisu2(char* buf, int& exponent, double v)
+{
+	Boundaries b = boundaries(v);
+	const CachedPower& cached = cached_power(b.plus.e);
+	DiyFp c{ cached.f, cached.e };
+	DiyFp w = mul(b.w, c);
+	DiyFp minus = mul(b.minus, c);
+	DiyFp plus = mul(b.plus, c);
+	// the products are only accurate to 1 ulp, so the boundaries are narrowed by one
+	minus.f++;
+	plus.f--;
+	exponent = -cached.k;
+	return generate_digits(buf, exponent, minus, w, plus);
+}
+
+char* append_exponent(char* p, int e)
+{
+	*p++ = 'e';
+	*p++ = e < 0 ? '-' : '+';
+	if (e < 0)
+		e = -e;
+	if (e >= 100)
+	{
+		*p++ = char('0' + e / 100);
+		e %= 100;
+	}
+	*p++ = char('0' + e / 10);
+	*p++ = char('0' + e % 10);
+	return p;
+}
+
+}  // namespace
+
+size_t format_double(double v, char* out)
+{
+	char* p = out;
+	if (v < 0 || (v == 0 && 1 / v < 0))
+	{
+		*p++ = '-';
+		v = -v;
+	}
+	if (v == 0)
+	{
+		*p++ = '0';
+		return size_t(p - out);
+	}
+
+	char digits[18];
+	int exponent;
+	int len = grisu2(digits, exponent, v);
+	int point = len + exponent;						// the position of the decimal point, relative to the first digit
+
+	if (exponent >= 0 && point <= 15)
+	{
+		// an integer: 1234500
+		memcpy(p, digits, len);
+		p += len;
+		for (int i = 0; i < exponent; i++)
+			*p++ = '0';
+	}
+	else if (point > 0 && point <= 15)
+	{
+		// 12.345
+		memcpy(p, digits, point);
+		p += point;
+		*p++ = '.';
+		memcpy(p, digits + point, len - point);
+		p += len - point;
+	}
+	else if (point > -4 && point <= 0)
+	{
+		// 0.0012345
+		*p++ = '0';
+		*p++ = '.';
+		for (int i = point; i < 0; i++)
+			*p++ = '0';
+		memcpy(p, digits, len);
+		p += len;
+	}
+	else
+	{
+		// 1.2345e-07
+		*p++ = digits[0];
+		if (len > 1)
+		{
+			*p++ = '.';
+			memcpy(p, digits + 1, len - 1);
+			p += len - 1;
+		}
+		p = append_exponent(p, point - 1);
+	}
+	return size_t(p - out);
+}
@@ -0,0 +1,19 @@
+#ifndef DTOA_H
+#define DTOA_H
+#include <stddef.h>
+
+// The maximum length of format_double(), without the terminating zero
+static const size_t FORMAT_DOUBLE_MAX = 24;
+
+/**
+* Format a finite double into its shortest decimal representation which reads back ( strtod() ) as the same double.
+* It uses the Grisu2 algorithm ( F. Loitsch: Printing Floating-Point Numbers Quickly and Accurately with Integers, 2010 ), which
+* needs only 64 bit integer arithmetic. The result always reads back exactly, and it's the shortest one for ~99.9% of the values
+* ( otherwise it's one digit longer ). The output is a valid JSON number: 0.125, -3, 1.5e-07 or 2e+22
+* @param v The value, it must be finite
+* @param out At least FORMAT_DOUBLE_MAX characters, the result is not zero terminated
+* @output The length of the result
+*/
+size_t format_double(double v, char* out);
+
+#endif  // DTOA_H
@@ -0,0 +1,100 @@
+#include <string.h>
+#include "latency.h"
+#include "logger.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+void LatencyHistogram::reset()
+{
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+	maxvalue = 0;
+}
+
+// The first SUB_COUNT values have their own buckets, after that every power of 2 range is split into SUB_COUNT buckets.
+int LatencyHistogram::bucket_index(uint64_t ns)
+{
+	if (ns < uint64_t(SUB_COUNT))
+		return int(ns);
+	int msb = 63 - __builtin_clzll(ns);
+	if (msb >= MAX_BITS)
+		return BUCKET_COUNT - 1;
+	int shift = msb - SUB_BITS;
+	return (shift + 1) * SUB_COUNT + int((ns >> shift) & (SUB_COUNT - 1));
+}
+
+uint64_t LatencyHistogram::bucket_upper(int idx)
+{
+	if (idx < SUB_COUNT)
+		return uint64_t(idx);
+	int shift = idx / SUB_COUNT - 1;
+	uint64_t sub = uint64_t(idx % SUB_COUNT) + SUB_COUNT;
+	return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	counts[bucket_index(ns)]++;
+	total++;
+	if (ns > maxvalue)
+		maxvalue = ns;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	for (int i = 0; i < BUCKET_COUNT; i++)
+		counts[i] += other.counts[i];
+	total += other.total;
+	if (other.maxvalue > maxvalue)
+		maxvalue = other.maxvalue;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	if (total == 0)
+		return 0;
+	uint64_t rank = uint64_t(p / 100.0 * double(total) + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKET_COUNT; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+		{
+			uint64_t upper = bucket_upper(i);
+			return upper < maxvalue ? upper : maxvalue;
+		}
+	}
+	return maxvalue;
+}
+
+// LatencyStats
+
+std::atomic<unsigned int> LatencyStats::dump_generation(0);
+
+LatencyStats::LatencyStats()
+{
+	begin = last = 0;
+	dumped_generation = dump_generation.load(std::memory_order_relaxed);
+}
+
+void LatencyStats::dump() const
+{
+	// the format strings must be literals for the logger
+	static const char* formats[] = {
+		"Latency parse:  n={} p50={}ns p99={}ns p99.9={}ns max={}ns",
+		"Latency logic:  n={} p50={}ns p99={}ns p99.9={}ns max={}ns",
+		"Latency encode: n={} p50={}ns p99={}ns p99.9={}ns max={}ns",
+		"Latency send:   n={} p50={}ns p99={}ns p99.9={}ns max={}ns",
+		"Latency total:  n={} p50={}ns p99={}ns p99.9={}ns max={}ns",
+	};
+	for (int i = 0; i < int(LatencyStage::COUNT); i++)
+	{
+		const LatencyHistogram& h = histograms[i];
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, formats[i], h.count(), h.percentile(50), h.percentile(99), h.percentile(99.9), h.max());
+	}
+}
@@ -0,0 +1,112 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+// The current time of the monotonic clock in nanoseconds
+inline uint64_t monotonic_ns()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// LatencyHistogram class:
+//   An HDR-style histogram of durations in nanoseconds, with constant memory and O(1) recording.
+//   Every power of 2 range is divided into 32 linear sub-buckets, so the values are stored with ~3% precision, from 1ns up to ~4.3s.
+//   ( longer durations are counted in the last bucket )
+class LatencyHistogram {
+
+public:
+	LatencyHistogram();
+
+	void record(uint64_t ns);
+
+	// Add the counts of another histogram to this one
+	void merge(const LatencyHistogram& other);
+
+	void reset();
+
+	uint64_t count() const { return total; }
+	uint64_t max() const { return maxvalue; }
+
+	/**
+	* Get a percentile of the recorded values
+	* @param p The percentile, in the [0,100] interval
+	* @output The upper bound of the bucket which contains the percentile. (0 if there are no values)
+	*/
+	uint64_t percentile(double p) const;
+
+private:
+	static const int SUB_BITS = 5;
+	static const int SUB_COUNT = 1 << SUB_BITS;
+	static const int MAX_BITS = 32;
+	static const int BUCKET_COUNT = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+	static int bucket_index(uint64_t ns);
+	static uint64_t bucket_upper(int idx);
+
+	uint32_t counts[BUCKET_COUNT];
+	uint64_t total;
+	uint64_t maxvalue;
+};
+
+// The measured stages of processing one message
+enum class LatencyStage {
+	PARSE,						// decoding the telemetry ( in pipelined mode: receiving and decoding it, and passing it to the control thread )
+	LOGIC,						// the PID controllers ( logic() )
+	ENCODE,						// formatting the reply
+	SEND,						// ws.send() ( in pipelined mode: posting the reply to the event loop )
+	TOTAL,						// from receiving the message until the reply is sent
+	COUNT
+};
+
+// LatencyStats class:
+//   The latency histograms of all stages of one connection, with the timestamps of the message being processed.
+//   It's only accessed by the thread of its connection.
+class LatencyStats {
+
+public:
+	LatencyStats();
+
+	// Called at the start of processing a message, and after each stage of it
+	void start() { last = begin = monotonic_ns(); }
+	// Start at an earlier time, when the message was received by another thread
+	void start(uint64_t received) { begin = received; last = monotonic_ns(); }
+	void stage(LatencyStage s) {
+		uint64_t now = monotonic_ns();
+		histograms[int(s)].record(now - last);
+		last = now;
+	}
+	// Called when the reply is sent, it records the SEND and the TOTAL stages
+	void sent() {
+		stage(LatencyStage::SEND);
+		histograms[int(LatencyStage::TOTAL)].record(last - begin);
+	}
+
+	const LatencyHistogram& histogram(LatencyStage s) const { return histograms[int(s)]; }
+
+	// Write the p50/p99/p99.9/max values of all stages to the console log
+	void dump() const;
+
+	// Dump the statistics if request_dump() was called since the last check
+	void dump_if_requested() {
+		unsigned int gen = dump_generation.load(std::memory_order_relaxed);
+		if (gen != dumped_generation) {
+			dumped_generation = gen;
+			dump();
+		}
+	}
+
+	// Ask every connection to dump its statistics when it processes its next message. Async-signal safe.
+	static void request_dump() { dump_generation.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+	static std::atomic<unsigned int> dump_generation;
+
+	LatencyHistogram histograms[int(LatencyStage::COUNT)];
+	uint64_t begin;
+	uint64_t last;
+	unsigned int dumped_generation;
+};
+
+#endif  // LATENCY_H
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#ifndef UWS_VCPKG
+	// The websocket client is only available in the Udacity version of the uwebsockets library
+	#include <uWS/uWS.h>
+	#include <uv.h>
+#endif
+
+#include "simulator.h"
+#include "session.h"
+#include "trace.h"
+#include "latency.h"
+#include "logger.h"
+
+// pid_loadgen: a load generator for the pid application.
+//   pid_loadgen [--connect=ws://127.0.0.1:4567] [--connections=N] [--rate=HZ] [--duration=S] [--trace=<file>]
+//     --connections	The number of concurrent websocket connections ( 1 by default )
+//     --rate			Telemetry messages per second on every connection. 0 ( default ) means flat-out: the next message is sent
+//					as soon as the reply of the previous one arrives.
+//     --duration		The length of the measurement in seconds ( 10 by default )
+//     --trace			Replay the telemetry of this trace file ( recorded with the --trace option of pid ). Without it, a synthetic
+//					trace is generated by driving the headless simulator for 4500 steps.
+//   At the end the throughput, the round-trip latency distribution, and the number of late and lost replies are printed.
+//   Every message carries a "seq" field, a sequence number of its connection, which pid echoes in its reply. The replies are
+//   matched to the messages by it, so the round trips stay right when the server drops or coalesces messages ( a reply to a later
+//   message skips the earlier ones, they are counted as dropped by the server ), or sends replies of its own ( the resets of the
+//   watchdog have no seq, they are counted as unmatched and not measured ).
+//   A reply is late if it arrives after the next message of its connection was due ( only with --rate ), and it's lost if it does not arrive at all.
+//   In flat-out mode a message without a reply for 100ms is given up as lost, and the next one is sent.
+
+// The telemetry messages to send, in a loop
+static std::vector<Telemetry> load_frames(const char* trace_path)
+{
+	std::vector<Telemetry> frames;
+	if (trace_path)
+	{
+		TraceReader reader;
+		if (reader.open(trace_path))
+		{
+			for (const TraceRecord& rec : reader)
+				frames.push_back(Telemetry{ rec.cte, rec.speed, rec.angle });
+		}
+		return frames;
+	}
+
+	Track track = Track::default_track();
+	VehicleSim sim(track);
+	SessionConfig config;
+	Session session(config);
+	for (int i = 0; i < 4500; i++)
+	{
+		Telemetry t = sim.telemetry();
+		double steer_value, throttle;
+		logic(session.pid, session.pid_throttle, session.optimal_speed, t.cte, t.speed, t.angle, steer_value, throttle);
+		frames.push_back(t);
+		sim.step(steer_value, throttle);
+	}
+	return frames;
+}
+
+#ifndef UWS_VCPKG
+
+// The state of one connection
+struct Connection {
+	static const int MAX_INFLIGHT = 1024;
+
+	std::unique_ptr<uWS::WebSocket<uWS::CLIENT>> ws;	// set when the connection is open
+	bool connected = false;
+	size_t next_frame = 0;
+	uint64_t next_due = 0;					// when the next message must be sent ( rate mode )
+	uint64_t sent_at[MAX_INFLIGHT];			// the send times of the messages waiting for a reply, indexed by seq % MAX_INFLIGHT
+	uint64_t due_after[MAX_INFLIGHT];		// when the message after it was due
+	uint64_t head = 1, tail = 1;			// the seq of the oldest message waiting for a reply, and of the next message
+	ReplyWriter writer;
+};
+
+struct LoadGen {
+	std::vector<Telemetry> frames;
+	std::vector<std::unique_ptr<Connection>> connections;
+	uint64_t interval = 0;					// ns between messages of a connection, 0 in flat-out mode
+	uint64_t start = 0, stop = 0;
+	uint64_t sent = 0, replies = 0, late = 0, overflow = 0;
+	uint64_t skipped = 0;					// the messages without a reply, as the reply of a later message arrived first
+	uint64_t unmatched = 0;					// the replies without a seq of a message in flight
+	uint64_t timeouts = 0;					// the messages given up in flat-out mode
+	int open_count = 0;
+	LatencyHistogram rtt;
+	bool finished = false;
+
+	void send(Connection& c, uint64_t now) {
+		if (c.tail - c.head == uint64_t(Connection::MAX_INFLIGHT))
+		{
+			overflow++;
+			return;
+		}
+		Telemetry t = frames[c.next_frame];
+		t.seq = double(c.tail);
+		size_t len = c.writer.telemetry(t);
+		c.next_frame = (c.next_frame + 1) % frames.size();
+		c.sent_at[c.tail % Connection::MAX_INFLIGHT] = now;
+		c.due_after[c.tail % Connection::MAX_INFLIGHT] = interval ? now + interval : UINT64_MAX;
+		c.tail++;
+		sent++;
+		c.ws->send(c.writer.data(), len, uWS::OpCode::TEXT);
+	}
+
+	// Match a reply to its message by the seq ( 0 if it has none ), true if it's the reply of a message in flight
+	bool reply(Connection& c, double seq, uint64_t now) {
+		if (!(seq >= double(c.head) && seq < double(c.tail)))
+		{
+			unmatched++;
+			return false;
+		}
+		uint64_t s = uint64_t(seq);
+		size_t idx = s % Connection::MAX_INFLIGHT;
+		rtt.record(now - c.sent_at[idx]);
+		if (now > c.due_after[idx])
+			late++;
+		skipped += s - c.head;
+		c.head = s + 1;
+		replies++;
+		return true;
+	}
+
+	// Give up the messages in flight of a connection in flat-out mode, if the oldest one had no reply for 100ms
+	bool timed_out(Connection& c, uint64_t now) {
+		if (c.head == c.tail || now - c.sent_at[c.head % Connection::MAX_INFLIGHT] < 100000000)
+			return false;
+		timeouts += c.tail - c.head;
+		c.head = c.tail;
+		return true;
+	}
+
+	void report() const {
+		double seconds = double(stop - start) / 1e9;
+		uint64_t lost = sent - replies - skipped;
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connections: {} Duration: {}s Sent: {} Replies: {} Throughput: {} replies/s",
+			connections.size(), seconds, sent, replies, double(replies) / seconds);
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Round trip: p50={}ns p99={}ns p99.9={}ns max={}ns",
+			rtt.percentile(50), rtt.percentile(99), rtt.percentile(99.9), rtt.max());
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Late replies: {} Lost replies: {} ( given up: {} ) Not sent ( too many in flight ): {}", late, lost, timeouts, overflow);
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Dropped or coalesced by the server: {} Unmatched replies: {}", skipped, unmatched);
+	}
+};
+
+static int run(LoadGen& gen, const char* uri, int connections, double duration)
+{
+	uWS::Hub h;
+
+	h.onConnection([&gen](uWS::WebSocket<uWS::CLIENT> ws, uWS::HttpRequest req) {
+		Connection* c = static_cast<Connection*>(ws.getUserData());
+		c->ws.reset(new uWS::WebSocket<uWS::CLIENT>(ws));
+		c->connected = true;
+		gen.open_count++;
+		// the measurement starts when all the connections are open
+		if (gen.open_count == int(gen.connections.size()))
+		{
+			uint64_t now = monotonic_ns();
+			gen.start = now;
+			for (auto& conn : gen.connections)
+			{
+				conn->next_due = now;
+				if (gen.interval == 0)
+					gen.send(*conn, now);
+			}
+		}
+	});
+
+	h.onMessage([&gen](uWS::WebSocket<uWS::CLIENT> ws, char *data, size_t length, uWS::OpCode opCode) {
+		uint64_t now = monotonic_ns();
+		Connection* c = static_cast<Connection*>(ws.getUserData());
+		double steer_value, throttle, seq;
+		MessageKind kind = decode_reply(data, length, steer_value, throttle, &seq);
+		if (kind != MessageKind::STEER && kind != MessageKind::RESET && kind != MessageKind::MANUAL)
+			return;
+		// in flat-out mode only the reply of the message in flight sends the next one
+		if (gen.reply(*c, seq, now) && gen.interval == 0 && !gen.finished)
+			gen.send(*c, now);
+	});
+
+	h.onDisconnection([&gen](uWS::WebSocket<uWS::CLIENT> ws, int code, char *message, size_t length) {
+		Connection* c = static_cast<Connection*>(ws.getUserData());
+		c->connected = false;
+	});
+
+	h.onError([](void* user) {
+		std::cerr << "Failed to connect" << std::endl;
+		exit(-1);
+	});
+
+	for (int i = 0; i < connections; i++)
+	{
+		gen.connections.emplace_back(new Connection());
+		h.connect(uri, gen.connections.back().get());
+	}
+
+	// 1ms tick: sends the due messages in rate mode, gives up the lost ones in flat-out mode, and ends the measurement
+	struct Tick {
+		LoadGen* gen;
+		uWS::Hub* hub;
+		uint64_t duration;
+	} tick = { &gen, &h, uint64_t(duration * 1e9) };
+	uv_timer_t timer;
+	timer.data = &tick;
+	uv_timer_init(h.getLoop(), &timer);
+	uv_timer_start(&timer, [](uv_timer_t* t) {
+		Tick* tick = static_cast<Tick*>(t->data);
+		LoadGen& gen = *tick->gen;
+		if (gen.start == 0)
+			return;
+		uint64_t now = monotonic_ns();
+		if (gen.finished)
+		{
+			// the replies of the last messages had 100ms to arrive
+			if (now - gen.stop > 100000000)
+			{
+				uv_timer_stop(t);
+				uv_close(reinterpret_cast<uv_handle_t*>(t), nullptr);
+				tick->hub->getDefaultGroup<uWS::CLIENT>().close();
+				tick->hub->getDefaultGroup<uWS::SERVER>().close();
+			}
+			return;
+		}
+		if (now - gen.start >= tick->duration)
+		{
+			gen.finished = true;
+			gen.stop = now;
+			return;
+		}
+		if (gen.interval)
+		{
+			for (auto& c : gen.connections)
+			{
+				while (c->connected && c->next_due <= now)
+				{
+					gen.send(*c, now);
+					c->next_due += gen.interval;
+				}
+			}
+		}
+		else
+		{
+			for (auto& c : gen.connections)
+			{
+				if (c->connected && gen.timed_out(*c, now))
+					gen.send(*c, now);
+			}
+		}
+	}, 1, 1);
+
+	h.run();
+	if (gen.start == 0)
+	{
+		std::cerr << "Not all the connections could be opened" << std::endl;
+		return -1;
+	}
+	gen.report();
+	return 0;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	const char* uri = "ws://127.0.0.1:4567";
+	const char* trace_path = nullptr;
+	int connections = 1;
+	double rate = 0;
+	double duration = 10;
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (strncmp(arg, "--connect=", 10) == 0)
+			uri = arg + 10;
+		else if (strncmp(arg, "--connections=", 14) == 0)
+			connections = atoi(arg + 14);
+		else if (strncmp(arg, "--rate=", 7) == 0)
+			rate = atof(arg + 7);
+		else if (strncmp(arg, "--duration=", 11) == 0)
+			duration = atof(arg + 11);
+		else if (strncmp(arg, "--trace=", 8) == 0)
+			trace_path = arg + 8;
+		else
+		{
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return -1;
+		}
+	}
+
+	std::vector<Telemetry> frames = load_frames(trace_path);
+	if (frames.empty())
+	{
+		std::cerr << "No telemetry to send" << std::endl;
+		return -1;
+	}
+
+	int ret;
+#ifndef UWS_VCPKG
+	LoadGen gen;
+	gen.frames.swap(frames);
+	gen.interval = rate > 0 ? uint64_t(1e9 / rate) : 0;
+	ret = run(gen, uri, std::max(1, connections), duration);
+#else
+	(void)uri; (void)connections; (void)rate; (void)duration;
+	std::cerr << "The websocket client is not supported with this uwebsockets library" << std::endl;
+	ret = -1;
+#endif
+	Logger::instance().flush();
+	return ret;
+}
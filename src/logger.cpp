@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <chrono>
+#include "logger.h"
+
+Logger& Logger::instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::Logger()
+{
+	for (size_t i = 0; i < RING_SIZE; i++)
+		ring[i].seq.store(i, std::memory_order_relaxed);
+	enqueue_pos.store(0, std::memory_order_relaxed);
+	dequeue_pos = 0;
+	written_pos.store(0, std::memory_order_relaxed);
+	dropped_count.store(0, std::memory_order_relaxed);
+
+	for (int i = 0; i < int(LogChannel::COUNT); i++)
+	{
+		levels[i].store(int(LogLevel::OFF), std::memory_order_relaxed);
+		files[i] = nullptr;
+	}
+	files[int(LogChannel::CONSOLE)] = stdout;
+	levels[int(LogChannel::CONSOLE)].store(int(LogLevel::INFO), std::memory_order_relaxed);
+
+	running = true;
+	worker = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger()
+{
+	running = false;
+	worker.join();
+	for (int i = 0; i < int(LogChannel::COUNT); i++)
+	{
+		if (files[i] && files[i] != stdout)
+			fclose(files[i]);
+	}
+}
+
+void Logger::set_level(LogChannel ch, LogLevel level)
+{
+	levels[int(ch)].store(int(level), std::memory_order_relaxed);
+}
+
+bool Logger::open_file(LogChannel ch, const char* path, LogLevel level)
+{
+	FILE* f = fopen(path, "w");
+	if (!f)
+		return false;
+
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(file_lock);
+		if (files[int(ch)] && files[int(ch)] != stdout)
+			fclose(files[int(ch)]);
+		files[int(ch)] = f;
+	}
+	set_level(ch, level);
+	return true;
+}
+
+void Logger::flush()
+{
+	size_t target = enqueue_pos.load(std::memory_order_acquire);
+	while (written_pos.load(std::memory_order_acquire) < target)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// Producer side of the bounded, multi-producer ring buffer: claim a slot by advancing enqueue_pos, then fill it and publish it through its seq.
+void Logger::push(LogChannel ch, const char* fmt, const double* args, int nargs)
+{
+	Cell* cell;
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		cell = &ring[pos & (RING_SIZE - 1)];
+		size_t seq = cell->seq.load(std::memory_order_acquire);
+		intptr_t diff = intptr_t(seq) - intptr_t(pos);
+		if (diff == 0)
+		{
+			if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// full, the background thread can not keep up
+			dropped_count.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+		{
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->rec.fmt = fmt;
+	cell->rec.ch = ch;
+	cell->rec.nargs = nargs;
+	for (int i = 0; i < nargs; i++)
+		cell->rec.args[i] = args[i];
+	cell->seq.store(pos + 1, std::memory_order_release);
+}
+
+// Consumer side, only called by the background thread
+bool Logger::pop(Record& rec)
+{
+	Cell* cell = &ring[dequeue_pos & (RING_SIZE - 1)];
+	if (cell->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+		return false;
+	rec = cell->rec;
+	cell->seq.store(dequeue_pos + RING_SIZE, std::memory_order_release);
+	dequeue_pos++;
+	return true;
+}
+
+void Logger::output(const Record& rec)
+{
+	FILE* f = files[int(rec.ch)];
+	if (!f)
+		return;
+
+	char line[1024];
+	size_t len = 0;
+	int argidx = 0;
+	for (const char* p = rec.fmt; *p && len < sizeof(line) - 64; p++)
+	{
+		if (p[0] == '{' && p[1] == '}' && argidx < rec.nargs)
+		{
+			double v = rec.args[argidx++];
+			// integers ( counters, nanoseconds ) are written with all of their digits
+			if (v < 1e15 && v > -1e15 && v == double(int64_t(v)))
+				len += snprintf(line + len, sizeof(line) - len, "%lld", (long long)v);
+			else
+				len += snprintf(line + len, sizeof(line) - len, "%g", v);
+			p++;
+		}
+		else
+		{
+			line[len++] = *p;
+		}
+	}
+	line[len++] = '\n';
+	fwrite(line, 1, len, f);
+}
+
+void Logger::run()
+{
+	int idle = 0;
+	for (;;)
+	{
+		Record rec;
+		size_t n = 0;
+		{
+			std::lock_guard<std::mutex> lock(file_lock);
+			while (pop(rec))
+			{
+				output(rec);
+				n++;
+			}
+			if (n)
+			{
+				for (int i = 0; i < int(LogChannel::COUNT); i++)
+				{
+					if (files[i])
+						fflush(files[i]);
+				}
+			}
+		}
+		if (n)
+		{
+			written_pos.fetch_add(n, std::memory_order_release);
+			idle = 0;
+			continue;
+		}
+		if (!running)
+			break;
+
+		// back off while there is nothing to write, up to 10ms
+		if (idle < 10)
+			idle++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(idle));
+	}
+}
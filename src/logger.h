@@ -0,0 +1,120 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// The output channels of the logger
+enum class LogChannel {
+	CONSOLE,					// standard output
+	TRAINING,					// the log file of PIDTRAINER ( only written if opened with Logger::open_file() )
+	COUNT
+};
+
+// Verbosity levels. A record is written if its level is not above the level of its channel.
+enum class LogLevel {
+	OFF,
+	ERROR,
+	INFO,
+	DEBUG,
+};
+
+// Logger class:
+//   An asynchronous logger to keep the slow, blocking writes off the control path.
+//   The callers only copy a fixed-size binary record ( the format string pointer and up to 12 numeric arguments ) into a lock-free ring buffer,
+//   and a background thread formats them and writes them out. If the ring buffer is full, the record is dropped and counted.
+//   The format string must be a string literal ( only its address is stored ), and every {} in it is replaced by the next argument.
+//   Use it through the LOG() macro, which does not even evaluate the arguments if the level is not enabled.
+class Logger {
+
+public:
+	static const int MAX_ARGS = 12;
+
+	// The only instance, the background thread is started at the first use.
+	static Logger& instance();
+
+	~Logger();
+
+	/**
+	* Set the verbosity of a channel
+	* @param ch The channel
+	* @param level Records above this level are not written
+	*/
+	void set_level(LogChannel ch, LogLevel level);
+
+	// Check if records on this level would be written to the channel
+	bool enabled(LogChannel ch, LogLevel level) const {
+		return int(level) <= levels[int(ch)].load(std::memory_order_relaxed);
+	}
+
+	/**
+	* Open a log file for a channel. The previous file of the channel is closed.
+	* @param ch The channel
+	* @param path The file to create
+	* @param level The verbosity of the channel
+	* @output false if the file could not be created
+	*/
+	bool open_file(LogChannel ch, const char* path, LogLevel level = LogLevel::INFO);
+
+	// Queue a record. Numeric arguments only, they are stored as doubles.
+	template <typename... Args>
+	void write(LogChannel ch, const char* fmt, Args... args) {
+		static_assert(sizeof...(Args) <= MAX_ARGS, "Too many log arguments");
+		double v[] = { double(args)..., 0 };
+		push(ch, fmt, v, int(sizeof...(Args)));
+	}
+
+	// Wait until all the queued records are written out
+	void flush();
+
+	// The number of records dropped because the ring buffer was full
+	size_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+
+private:
+	struct Record {
+		const char* fmt;
+		double args[MAX_ARGS];
+		int nargs;
+		LogChannel ch;
+	};
+
+	// One slot of the ring buffer. seq tells whether the slot is free for the producer or filled for the consumer.
+	struct Cell {
+		std::atomic<size_t> seq;
+		Record rec;
+	};
+
+	static const size_t RING_SIZE = 4096;				// must be a power of 2
+
+	Logger();
+	Logger(const Logger&) = delete;
+	Logger& operator=(const Logger&) = delete;
+
+	void push(LogChannel ch, const char* fmt, const double* args, int nargs);
+	bool pop(Record& rec);
+	void output(const Record& rec);
+	void run();
+
+	Cell ring[RING_SIZE];
+	std::atomic<size_t> enqueue_pos;
+	size_t dequeue_pos;								// only used by the background thread
+	std::atomic<size_t> written_pos;				// the number of records written out, used by flush()
+	std::atomic<size_t> dropped_count;
+
+	std::atomic<int> levels[int(LogChannel::COUNT)];
+	std::mutex file_lock;							// guards files[], only taken by the background thread and open_file()
+	FILE* files[int(LogChannel::COUNT)];
+
+	std::atomic<bool> running;
+	std::thread worker;
+};
+
+#define LOG(ch, level, ...) \
+	do { \
+		if (Logger::instance().enabled(ch, level)) \
+			Logger::instance().write(ch, __VA_ARGS__); \
+	} while (0)
+
+#endif  // LOGGER_H
@@ -1,22 +1,34 @@
-﻿#include <math.h>
+﻿#include <ctype.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 #include <string>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifdef UWS_VCPKG
 	// On windows, using the latest uwebsockets library
 	#include <uwebsockets/App.h>
-	#include "json_300.hpp"
 
 #else
 	// When the Udacity version of the uwebsockets library is used
 	#include <uWS/uWS.h>
-	#include "json.hpp"
+	#include <uv.h>
 #endif 
 
-#include "PID.h"
+#include "session.h"
+#include "pipeline.h"
+#include "logger.h"
 
 // for convenience
-using nlohmann::json;
 using std::string;
 using std::min;
 using std::max;
@@ -26,214 +38,947 @@ using std::endl;
 constexpr double pi() { return M_PI; }
 double deg2rad(double x) { return x * pi() / 180; }
 double rad2deg(double x) { return x * 180 / pi(); }
-PIDTRAINER* pt = nullptr;
 
-#ifdef USE_TRAINING
-	double optimal_speed = 50;
-#else 
-	double optimal_speed = 30;
-#endif 
+// The settings of the websocket server
+struct ServerConfig {
+	int port = 4567;
+	int threads = 1;			// the number of event loop threads, each of them listens on the port
+	WatchdogConfig watchdog;
+	double speed = 0;			// the --speed option, 0 means the default target speed of the mode
+	bool deltas_given = false;	// the --deltas option was used ( otherwise they are 10% of the --params )
+	bool pipeline = false;		// run the controllers on a control thread per event loop ( see PipelinedLoop )
+	int pipeline_cpu = -1;		// pin the control thread of the first event loop to this CPU, the next ones to the next CPUs ( -1 = don't pin )
+	bool coalesce = false;		// only answer the latest telemetry of a connection, drop the superseded ones ( see post_message() )
+};
 
-// Checks if the SocketIO event has JSON data.
-// If there is data the JSON object in string format will be returned,
-// else the empty string "" will be returned.
-string hasData(string s) {
-  auto found_null = s.find("null");
-  auto b1 = s.find_first_of("[");
-  auto b2 = s.find_last_of("]");
-  if (found_null != string::npos) {
-    return "";
-  }
-  else if (b1 != string::npos && b2 != string::npos) {
-    return s.substr(b1, b2 - b1 + 1);
-  }
-  return "";
+// Parse a comma separated list of 3 numbers ( P,I,D )
+static bool parse_triple(const char* s, double v[3])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		char* end;
+		v[i] = strtod(s, &end);
+		if (end == s || *end != (i < 2 ? ',' : '\0'))
+			return false;
+		s = end + 1;
+	}
+	return true;
 }
 
-// initialize the PID controllers and if configured also init. the PIDTRAINER
-void init(int argc, char** argv, PID& pid, PID& pid_throttle)
+bool parse_config_file(const char* path, ServerConfig& server, SessionConfig& config);
+
+// process one --name=value option. Returns false if it's not a known option.
+//   --mode=drive|train				Drive with the configured coefficients ( default ), or train them with the PIDTRAINER.
+//   --config=<path>				Read the options from a file: one name=value ( or name ) per line, without the -- prefix. # starts a comment.
+//   --speed=<mph>					The target speed of the car. ( 30 by default, 50 in training mode )
+//   --params=<P,I,D>				The coefficients of the steering controller ( the initial ones in training mode )
+//   --deltas=<dP,dI,dD>				Training: the initial deltas of the optimizer ( 10% of the coefficients by default )
+//   --log-level=off|error|info|debug	The verbosity of the standard output. (info by default, debug prints every control step)
+//   --log-file=<path>				Write the log of the PIDTRAINER to this file.
+//   --optimizer=<name>				The optimization algorithm of the training: twiddle ( default ), nelder-mead, coordinate or cmaes
+//   --checkpoint=<path>				Save the state of the training into this file after every run, and resume from it at the start if it exists
+//   --stop-cte=<m>, --stop-cost, --stop-speed=<mph>, --stop-warmup=<n>
+//									Training: end the hopeless runs early ( see parse_early_stop_option() )
+//   --score-skip=<n>, --score-last=<n>, --score-range=<a:b>
+//									Training: score only a part of every run ( see parse_score_window_option() )
+//   --cost=<terms>					Training: the terms of the cost value, a comma separated list of cte ( always used ), speed and angle
+//   --objective=<name>				Training: the statistic of the sample costs used as the cost value of a run: mean ( default ), meanstd, max,
+//									or a percentile like p99
+//   --timing=<speed|measured>		The time step of the I and D terms: the 100/speed proxy ( default ), or the measured time between
+//									the telemetry messages ( see PID::UpdateError() )
+//   --threads=<n>					The number of event loop threads. (1 by default, 0 means one per CPU core)
+//   --latency						Measure the latency of the message processing stages. The histograms are dumped when a connection is closed,
+//									on SIGUSR1, and at the shutdown ( SIGINT, SIGTERM ) for the open connections
+//   --stall-timeout=<s>				Training: if the simulator does not send anything for this many seconds, its run is discarded and the
+//									connection is closed. The run is repeated when the simulator reconnects.
+//   --run-timeout=<s>				Training: restart the simulation run ( with the same parameters ) if it's not finished in this many seconds
+//   --restart-command=<cmd>			Training: the shell command to execute when the simulator is hung, to restart it
+//   --pipeline						Run the controllers on a separate control thread of every event loop thread, the event loop only does the I/O
+//									and the decoding of the messages ( see PipelinedLoop )
+//   --pipeline-cpu=<n>				--pipeline, with the control threads pinned to the CPU cores from n
+//   --coalesce						If more messages of a connection are waiting, only the latest one is answered, the others are dropped
+//									( latest wins ), so the control latency stays bounded under overload
+//   --trace=<prefix>				Record the control steps of every connection into a <prefix>.<n>.trace file ( see TraceWriter )
+//   --trace-capacity=<n>			The maximum number of records in a trace file ( 1M by default, 72 bytes each )
+bool parse_option(const char* arg, ServerConfig& server, SessionConfig& config)
 {
-	double p1, d1, i1;
+	static const char* levelnames[] = { "off", "error", "info", "debug" };
+	if (strncmp(arg, "--mode=", 7) == 0)
+	{
+		if (strcmp(arg + 7, "train") == 0)
+			config.training = true;
+		else if (strcmp(arg + 7, "drive") == 0)
+			config.training = false;
+		else
+			std::cerr << "Unknown mode " << (arg + 7) << std::endl;
+	}
+	else if (strncmp(arg, "--config=", 9) == 0)
+	{
+		if (!parse_config_file(arg + 9, server, config))
+			std::cerr << "Failed to read the config file " << (arg + 9) << std::endl;
+	}
+	else if (strncmp(arg, "--speed=", 8) == 0)
+	{
+		server.speed = atof(arg + 8);
+	}
+	else if (strncmp(arg, "--params=", 9) == 0)
+	{
+		if (!parse_triple(arg + 9, config.params))
+			std::cerr << "Invalid coefficients " << (arg + 9) << std::endl;
+		else if (!server.deltas_given)
+		{
+			for (int i = 0; i < 3; i++)
+				config.deltas[i] = config.params[i] * 0.1;
+		}
+	}
+	else if (strncmp(arg, "--deltas=", 9) == 0)
+	{
+		if (!parse_triple(arg + 9, config.deltas))
+			std::cerr << "Invalid deltas " << (arg + 9) << std::endl;
+		server.deltas_given = true;
+	}
+	else if (strncmp(arg, "--log-level=", 12) == 0)
+	{
+		for (int l = 0; l < 4; l++)
+		{
+			if (strcmp(arg + 12, levelnames[l]) == 0)
+				Logger::instance().set_level(LogChannel::CONSOLE, LogLevel(l));
+		}
+	}
+	else if (strncmp(arg, "--log-file=", 11) == 0)
+	{
+		if (!Logger::instance().open_file(LogChannel::TRAINING, arg + 11))
+			std::cerr << "Failed to create log file " << (arg + 11) << std::endl;
+	}
+	else if (strncmp(arg, "--optimizer=", 12) == 0)
+	{
+		if (!parse_optimizer(arg + 12, config.optimizer))
+			std::cerr << "Unknown optimizer " << (arg + 12) << ", using twiddle" << std::endl;
+	}
+	else if (strncmp(arg, "--checkpoint=", 13) == 0)
+	{
+		config.checkpoint = arg + 13;
+	}
+	else if (strncmp(arg, "--cost=", 7) == 0)
+	{
+		if (!parse_cost_terms(arg + 7, config.cost_terms))
+			std::cerr << "Unknown cost terms " << (arg + 7) << ", using cte" << std::endl;
+	}
+	else if (strncmp(arg, "--objective=", 12) == 0)
+	{
+		if (!parse_objective(arg + 12, config.objective))
+			std::cerr << "Unknown objective " << (arg + 12) << ", using mean" << std::endl;
+	}
+	else if (strncmp(arg, "--timing=", 9) == 0)
+	{
+		if (!parse_timing(arg + 9, config.timing))
+			std::cerr << "Unknown timing " << (arg + 9) << ", using speed" << std::endl;
+	}
+	else if (parse_early_stop_option(arg, config.early_stop))
+	{
+	}
+	else if (parse_score_window_option(arg, config.score_window))
+	{
+	}
+	else if (strncmp(arg, "--threads=", 10) == 0)
+	{
+		server.threads = atoi(arg + 10);
+		if (server.threads <= 0)
+			server.threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	else if (strcmp(arg, "--latency") == 0)
+	{
+		config.measure_latency = true;
+	}
+	else if (strncmp(arg, "--stall-timeout=", 16) == 0)
+	{
+		server.watchdog.stall_timeout = atof(arg + 16);
+	}
+	else if (strncmp(arg, "--run-timeout=", 14) == 0)
+	{
+		server.watchdog.run_timeout = atof(arg + 14);
+	}
+	else if (strncmp(arg, "--restart-command=", 18) == 0)
+	{
+		server.watchdog.restart_command = arg + 18;
+	}
+	else if (strcmp(arg, "--pipeline") == 0)
+	{
+		server.pipeline = true;
+	}
+	else if (strncmp(arg, "--pipeline-cpu=", 15) == 0)
+	{
+		server.pipeline = true;
+		server.pipeline_cpu = atoi(arg + 15);
+	}
+	else if (strcmp(arg, "--coalesce") == 0)
+	{
+		server.coalesce = true;
+	}
+	else if (strncmp(arg, "--trace=", 8) == 0)
+	{
+		config.trace_prefix = arg + 8;
+	}
+	else if (strncmp(arg, "--trace-capacity=", 17) == 0)
+	{
+		config.trace_capacity = strtoull(arg + 17, nullptr, 10);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
 
-	// the previously fine-tuned, best PID coefficients
-	p1 = 0.164142; 
-	i1 = 4.4004e-06;
-	d1 = 9.23562;
+// read the options from a config file
+bool parse_config_file(const char* path, ServerConfig& server, SessionConfig& config)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		// strip the comment and the whitespace around the option
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		char* begin = line;
+		while (isspace((unsigned char)*begin))
+			begin++;
+		char* end = begin + strlen(begin);
+		while (end > begin && isspace((unsigned char)end[-1]))
+			end--;
+		*end = '\0';
+		if (*begin == '\0')
+			continue;
+		// the spaces around the = are allowed too
+		string option = string("--") + begin;
+		size_t eq = option.find('=');
+		if (eq != string::npos)
+		{
+			size_t name_end = option.find_last_not_of(" \t", eq - 1) + 1;
+			size_t value_begin = option.find_first_not_of(" \t", eq + 1);
+			option = option.substr(0, name_end) + "=" + (value_begin == string::npos ? string() : option.substr(value_begin));
+		}
+		if (!parse_option(option.c_str(), server, config))
+			std::cerr << "Unknown option in " << path << ": " << begin << std::endl;
+	}
+	fclose(f);
+	return true;
+}
 
-#ifdef USE_TRAINING
-	double de1, de2, de3;
-	if (argc == 7)
+// process the --name=value options, and remove them from the argument list. The positional arguments are kept in their order.
+void parse_options(int& argc, char** argv, ServerConfig& server, SessionConfig& config)
+{
+	int n = 1;
+	for (int i = 1; i < argc; i++)
 	{
-		p1 = atof(argv[1]);
-		i1 = atof(argv[2]);
-		d1 = atof(argv[3]);
-		de1 = atof(argv[4]);
-		de2 = atof(argv[5]);
-		de3 = atof(argv[6]);
+		if (!parse_option(argv[i], server, config))
+			argv[n++] = argv[i];
 	}
+	argc = n;
+}
 
-	pt = new PIDTRAINER(&pid, 4500, p1, i1, d1, de1, de2, de3);
-#endif 
+// The period of the watchdog timer, in ms
+static const int WATCHDOG_PERIOD = 250;
+
+// --latency: the timer of every event loop dumps the latency of its connections when it's requested, even if they are idle.
+// At SIGINT or SIGTERM the process waits until every event loop did it ( at most a second ), then it exits.
+static std::atomic<bool> shutdown_requested(false);
+static std::atomic<int> loops_dumped(0);
 
-	pid.Init(p1, i1, d1);
-	pid_throttle.Init(999999, 0, 0);
+static void request_shutdown(int)
+{
+	// only lock-free atomics, it's called from a signal handler
+	shutdown_requested.store(true);
+	LatencyStats::request_dump();
 }
 
-// the logic which uses the 2 PID controllers to control the new steer_value and throttle
-void logic( PID &pid, PID &pid_throttle, double cte, double speed, double angle, double& steer_value, double& throttle) 
+static void shutdown_watcher(int loops)
 {
-	pid.UpdateError(cte, speed, angle);
-	steer_value = pid.TotalError();
-	steer_value = min(steer_value, 1.0);
-	steer_value = max(steer_value, -1.0);
-	pid_throttle.UpdateError(speed - optimal_speed, speed, angle);
-	throttle = pid_throttle.TotalError();
-	throttle = min(throttle, 1.0);
-	throttle = max(throttle, 0.0);
-};
+	while (!shutdown_requested.load())
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	uint64_t deadline = monotonic_ns() + 4 * WATCHDOG_PERIOD * uint64_t(1000000);
+	while (loops_dumped.load() < loops && monotonic_ns() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	LOG(LogChannel::CONSOLE, LogLevel::INFO, "Shutting down");
+	Logger::instance().flush();
+	_Exit(0);
+}
 
-// process an incoming websocket message
-// It contains the logic which restarts the simulation when a run is finished.
-std::string process_message(const char* data, size_t length, PID& pid, PID& pid_throttle)
+// parse the command line into the settings of the server and the sessions
+// In training mode, the initial coefficients and deltas can also be given as 6 numbers: P I D PDelta IDelta DDelta
+void init(int argc, char** argv, ServerConfig& server, SessionConfig& config)
 {
-	std::string msg;
-	if (length && length > 2 && data[0] == '4' && data[1] == '2') {
+	parse_options(argc, argv, server, config);
 
-		if (pt)
+	if (config.measure_latency)
+	{
+#ifdef SIGUSR1
+		signal(SIGUSR1, [](int) { LatencyStats::request_dump(); });
+#endif
+		signal(SIGINT, request_shutdown);
+		signal(SIGTERM, request_shutdown);
+		std::thread(shutdown_watcher, server.threads).detach();
+	}
+
+	if (config.training)
+	{
+		config.optimal_speed = 50;
+		if (argc == 7)
 		{
-			if (pid.samplenum == pt->target_samplenum) 
+			for (int i = 0; i < 3; i++)
 			{
-				pt->ready();
-				pid.samplenum = 0;
-				msg = "42[\"reset\",{}]";
-				return msg;
+				config.params[i] = atof(argv[1 + i]);
+				config.deltas[i] = atof(argv[4 + i]);
 			}
 		}
+	}
+	if (server.speed > 0)
+	{
+		config.optimal_speed = server.speed;
+	}
+	LOG(LogChannel::CONSOLE, LogLevel::INFO, "Mode: {} ( 0: drive, 1: train ) Target speed: {} mph", int(config.training), config.optimal_speed);
+}
 
-		auto s = hasData(string(data).substr(0, length));
+// Run the server on multiple event loop threads, if configured.
+// Every thread runs its own server ( calling run_server ) and the kernel distributes the new connections between them. (SO_REUSEPORT)
+// A connection stays on the thread which accepted it, so its session is only accessed by that thread, without any locking.
+template <typename F>
+int run_threads(const ServerConfig& server, F run_server)
+{
+	std::vector<std::thread> threads;
+	for (int i = 1; i < server.threads; i++)
+	{
+		threads.emplace_back([run_server] { run_server(); });
+	}
+	int ret = run_server();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	return ret;
+}
 
-		if (s != "") {
-			auto j = json::parse(s);
+// Start the restart command of the simulator. It runs on its own thread, so the event loop is not blocked while it's executed.
+void restart_simulator(const WatchdogConfig& watchdog)
+{
+	if (watchdog.restart_command.empty())
+		return;
+	LOG(LogChannel::CONSOLE, LogLevel::INFO, "Restarting the simulator");
+	std::string command = watchdog.restart_command;
+	std::thread([command] {
+		if (system(command.c_str()) != 0)
+			std::cerr << "The restart command failed" << std::endl;
+	}).detach();
+}
 
-			string event = j[0].get<string>();
+// The watched connections of an event loop thread, and the trainer of the last closed training session.
+// When a simulator reconnects, its new session continues the training with the parked trainer, so a hung simulator only costs the unfinished run.
+// ( With more event loop threads, the reconnected simulator may be accepted by another thread, which has its own parked trainer. )
+template <typename WS>
+struct LoopState {
+	struct Connection {
+		WS ws;
+		Session* session;
+	};
+	const WatchdogConfig& watchdog;
+	std::vector<Connection> connections;
+	std::unique_ptr<PIDTRAINER> parked;
+	std::vector<Connection> pending;		// coalescing mode: the connections with a message in the mailbox of their session
+	bool shutdown_dumped = false;
+
+	explicit LoopState(const WatchdogConfig& _watchdog) : watchdog(_watchdog) {}
+
+	// set up the session of a new connection
+	void opened(WS ws, Session* session) {
+		connections.push_back(Connection{ ws, session });
+		if (parked)
+		{
+			LOG(LogChannel::CONSOLE, LogLevel::INFO, "Continuing the training at run {}", parked->runs + 1);
+			session->adopt_trainer(std::move(parked));
+		}
+	}
 
-			if (event == "telemetry") {
-				// j[1] is the data JSON object
-				double cte = std::stod(j[1]["cte"].get<string>());
-				double speed = std::stod(j[1]["speed"].get<string>());
-				double angle = std::stod(j[1]["steering_angle"].get<string>());
-				double steer_value, throttle;
+	// save the trainer of a closed session
+	void closed(Session* session) {
+		for (size_t i = 0; i < connections.size(); i++)
+		{
+			if (connections[i].session == session)
+			{
+				connections.erase(connections.begin() + i);
+				break;
+			}
+		}
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			if (pending[i].session == session)
+			{
+				pending.erase(pending.begin() + i);
+				break;
+			}
+		}
+		if (session->trainer)
+			parked = session->release_trainer();
+	}
 
-				logic(pid, pid_throttle, cte, speed, angle, steer_value, throttle);
+	// coalescing mode: store a received message in the mailbox of the session, it's processed by process_pending()
+	void post(WS ws, Session* session, const char* data, size_t length) {
+		if (post_message(data, length, *session))
+			pending.push_back(Connection{ ws, session });
+	}
 
-				// DEBUG
-				std::cout << "CTE: " << cte << " Steering Value: " << steer_value
-					<< std::endl;
+	// coalescing mode: process the latest message of every connection, after the event loop has dispatched all the received messages
+	template <typename F>
+	void process_pending(F send) {
+		for (Connection& c : pending)
+		{
+			size_t msglen = process_mailbox(*c.session);
+			if (msglen)
+			{
+				send(c.ws, c.session->reply.data(), msglen);
+				if (c.session->latency)
+				{
+					c.session->latency->sent();
+				}
+			}
+		}
+		pending.clear();
+	}
 
-				json msgJson;
-				msgJson["steering_angle"] = steer_value;
-				msgJson["throttle"] = throttle;
-				msg = "42[\"steer\"," + msgJson.dump() + "]";
-				std::cout << msg << std::endl;
-			}  // end "telemetry" if
+	// the timer: dump the latency of the connections if it was requested ( SIGUSR1, shutdown )
+	void dump_latency() {
+		for (Connection& c : connections)
+		{
+			if (c.session->latency)
+				c.session->latency->dump_if_requested();
 		}
-		else {
-			// Manual driving
-			msg = "42[\"manual\",{}]";
+		if (shutdown_requested.load() && !shutdown_dumped)
+		{
+			shutdown_dumped = true;
+			loops_dumped++;
 		}
-	}  // end websocket message if 
-	return msg;
+	}
+
+	// the connections to restart their run ( with a reset message ), and to close
+	void check(std::vector<Connection>& retry, std::vector<Connection>& hung) {
+		uint64_t now = monotonic_ns();
+		for (Connection& c : connections)
+		{
+			switch (watchdog_check(*c.session, watchdog, now)) {
+			case WatchdogAction::RETRY_RUN:
+				retry.push_back(c);
+				break;
+			case WatchdogAction::DISCONNECT:
+				hung.push_back(c);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+};
+
+// The pipelined mode of an event loop thread ( --pipeline ):
+//   The event loop thread ( network thread ) only receives and decodes the messages, and sends the replies. The sessions are owned
+//   by the control thread of a ControlPipeline, which executes the controllers, the trainer and the watchdog checks.
+//   The connections are identified by ids in the pipeline, so a reply which arrives after its connection was closed is dropped.
+template <typename WS>
+struct PipelinedLoop {
+	// the user data of a websocket
+	struct Connection {
+		uint64_t id;
+		Session* session;
+	};
+
+	const SessionConfig& config;
+	std::function<void(WS, const char*, size_t)> send;		// the socket operations of the uWS version
+	std::function<void(WS)> close_socket;
+
+	// network thread
+	std::unordered_map<uint64_t, WS> sockets;
+	uint64_t next_id;
+	size_t dropped;					// the messages dropped because the control thread was behind
+
+	// control thread
+	LoopState<uint64_t> state;
+
+	std::unique_ptr<ControlPipeline> pipeline;
+
+	PipelinedLoop(const WatchdogConfig& watchdog, const SessionConfig& _config) : config(_config), next_id(1), dropped(0), state(watchdog) {}
+
+	/**
+	* Start the control thread
+	* @param wake Wakes up the event loop to call drain()
+	* @param cpu Pin the control thread to this CPU ( -1 = don't pin )
+	* @param coalesce Only execute the latest waiting message of a connection
+	*/
+	void start(std::function<void()> wake, int cpu, bool coalesce) {
+		pipeline.reset(new ControlPipeline([this](const PipelineCommand& cmd) { execute(cmd); }, std::move(wake), cpu, coalesce));
+	}
+
+	// Network thread: set up a new connection, the returned Connection is its user data
+	Connection* open(WS ws) {
+		// every simulator gets its own controllers
+		Connection* c = new Connection{ next_id++, new Session(config) };
+		sockets.emplace(c->id, ws);
+		submit(PipelineCommand{ PipelineCommand::OPEN, c->id, c->session });
+		return c;
+	}
+
+	// Network thread: decode a message and pass it on to the control thread
+	void message(Connection* c, const char* data, size_t length) {
+		if (length > 2 && data[0] == '4' && data[1] == '2')
+		{
+			PipelineCommand cmd{ PipelineCommand::MESSAGE, c->id, c->session };
+			cmd.received = monotonic_ns();
+			cmd.frames = 1;
+			cmd.message = decode_message(data, length, cmd.telemetry);
+			// the simulator sends the next telemetry anyway, so a message is rather dropped than blocking the event loop
+			if (!pipeline->submit(cmd))
+			{
+				dropped++;
+				LOG(LogChannel::CONSOLE, LogLevel::DEBUG, "The control thread is behind, {} messages dropped", dropped);
+			}
+		}
+	}
+
+	// Network thread: the connection was closed, its session is deleted by the control thread
+	void close(Connection* c) {
+		sockets.erase(c->id);
+		submit(PipelineCommand{ PipelineCommand::CLOSE, c->id, c->session });
+		delete c;
+	}
+
+	// Network thread: the watchdog timer
+	void tick() {
+		pipeline->submit(PipelineCommand{ PipelineCommand::TICK });
+	}
+
+	// Network thread: execute the replies of the control thread
+	void drain() {
+		pipeline->drain([this](const PipelineReply& r) {
+			auto it = sockets.find(r.conn);
+			if (it == sockets.end())
+				return;
+			if (r.kind == PipelineReply::SEND)
+				send(it->second, r.data, r.length);
+			else
+				close_socket(it->second);	// it calls the disconnection handler, which erases the socket
+		});
+	}
+
+private:
+	// the commands which must not be dropped wait for free space, while executing the replies, so the control thread can go on
+	void submit(const PipelineCommand& cmd) {
+		while (!pipeline->submit(cmd))
+		{
+			drain();
+			std::this_thread::yield();
+		}
+	}
+
+	// Control thread: execute a command
+	void execute(const PipelineCommand& cmd) {
+		switch (cmd.kind) {
+		case PipelineCommand::OPEN: {
+			bool resumed = bool(state.parked);
+			state.opened(cmd.conn, cmd.session);
+			if (resumed)
+			{
+				// the run is repeated from the start of the track
+				size_t msglen = cmd.session->reply.reset();
+				pipeline->reply(cmd.conn, cmd.session->reply.data(), msglen);
+			}
+			break;
+		}
+		case PipelineCommand::MESSAGE: {
+			Session* session = cmd.session;
+			size_t msglen = process_decoded(cmd.message, cmd.telemetry, cmd.received, cmd.frames, *session);
+			if (msglen)
+			{
+				pipeline->reply(cmd.conn, session->reply.data(), msglen);
+				if (session->latency)
+				{
+					session->latency->sent();
+				}
+			}
+			break;
+		}
+		case PipelineCommand::CLOSE:
+			state.closed(cmd.session);
+			delete cmd.session;
+			break;
+		case PipelineCommand::TICK: {
+			state.dump_latency();
+			std::vector<LoopState<uint64_t>::Connection> retry, hung;
+			state.check(retry, hung);
+			for (auto& c : retry)
+			{
+				size_t msglen = c.session->reply.reset();
+				pipeline->reply(c.ws, c.session->reply.data(), msglen);
+			}
+			for (auto& c : hung)
+			{
+				pipeline->close(c.ws);
+			}
+			if (!hung.empty())
+			{
+				restart_simulator(state.watchdog);
+			}
+			break;
+		}
+		}
+	}
+};
+
+// The index of the event loop thread, for pinning its control thread
+static int next_loop_index()
+{
+	static std::atomic<int> loops(0);
+	return loops++;
 }
 
 #ifndef UWS_VCPKG
 
-int main(int argc, char **argv) {
+// Run one uWS::Hub on the calling thread
+int run_hub(const ServerConfig& server, const SessionConfig& config) {
   uWS::Hub h;
+  typedef LoopState<uWS::WebSocket<uWS::SERVER>> State;
+  State state(server.watchdog);
+
+  typedef PipelinedLoop<uWS::WebSocket<uWS::SERVER>> Pipelined;
+  std::unique_ptr<Pipelined> pipelined;
+  uv_async_t wakeup;
+  if (server.pipeline)
+  {
+    pipelined.reset(new Pipelined(server.watchdog, config));
+    pipelined->send = [](uWS::WebSocket<uWS::SERVER> ws, const char* data, size_t length) { ws.send(data, length, uWS::OpCode::TEXT); };
+    pipelined->close_socket = [](uWS::WebSocket<uWS::SERVER> ws) { ws.close(); };
+    wakeup.data = pipelined.get();
+    uv_async_init(h.getLoop(), &wakeup, [](uv_async_t* a) { static_cast<Pipelined*>(a->data)->drain(); });
+    int index = next_loop_index();
+    pipelined->start([&wakeup] { uv_async_send(&wakeup); }, server.pipeline_cpu >= 0 ? server.pipeline_cpu + index : -1, server.coalesce);
+  }
+  Pipelined* pl = pipelined.get();
+
+  // coalescing without the pipeline: the messages are stored in the mailboxes of the sessions, and the latest ones are processed
+  // after all the messages received in the event loop iteration were dispatched
+  uv_check_t coalescing;
+  State* coalesced = (server.coalesce && !pl) ? &state : nullptr;
+  if (coalesced)
+  {
+    coalescing.data = coalesced;
+    uv_check_init(h.getLoop(), &coalescing);
+    uv_check_start(&coalescing, [](uv_check_t* c) {
+      static_cast<State*>(c->data)->process_pending([](uWS::WebSocket<uWS::SERVER> ws, const char* data, size_t length) {
+        ws.send(data, length, uWS::OpCode::TEXT);
+      });
+    });
+  }
 
-  PID pid;
-  PID pid_throttle;
-
-  init(argc, argv, pid, pid_throttle);
-
-  h.onMessage([&pid, &pid_throttle](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, 
+  h.onMessage([pl, coalesced](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, 
                      uWS::OpCode opCode) {
     // "42" at the start of the message means there's a websocket message event.
     // The 4 signifies a websocket message
     // The 2 signifies a websocket event
-	  auto msg = process_message(data, length, pid, pid_throttle);
-    if (!msg.empty())
+    if (pl)
+    {
+      Pipelined::Connection* c = static_cast<Pipelined::Connection*>(ws.getUserData());
+      if (c)
+      {
+        pl->message(c, data, length);
+      }
+      return;
+    }
+    Session* session = static_cast<Session*>(ws.getUserData());
+    if (!session)
+    {
+      return;
+    }
+    if (coalesced)
+    {
+      coalesced->post(ws, session, data, length);
+      return;
+    }
+	  auto msglen = process_message(data, length, *session);
+    if (msglen)
     {
-	    ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);	  
+	    ws.send(session->reply.data(), msglen, uWS::OpCode::TEXT);	  
+      if (session->latency)
+      {
+        session->latency->sent();
+      }
     }
   }); // end h.onMessage
 
-  h.onConnection([&h](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
-    std::cout << "Connected!!!" << std::endl;
+  h.onConnection([&config, &state, pl](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
+    if (pl)
+    {
+      ws.setUserData(pl->open(ws));
+      LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connected!!!");
+      return;
+    }
+    // every simulator gets its own controllers
+    Session* session = new Session(config);
+    ws.setUserData(session);
+    LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connected!!!");
+    bool resumed = bool(state.parked);
+    state.opened(ws, session);
+    if (resumed)
+    {
+      // the run is repeated from the start of the track
+      size_t msglen = session->reply.reset();
+      ws.send(session->reply.data(), msglen, uWS::OpCode::TEXT);
+    }
   });
 
-  h.onDisconnection([&h](uWS::WebSocket<uWS::SERVER> ws, int code, 
+  h.onDisconnection([&state, pl](uWS::WebSocket<uWS::SERVER> ws, int code, 
                          char *message, size_t length) {
+    if (pl)
+    {
+      Pipelined::Connection* c = static_cast<Pipelined::Connection*>(ws.getUserData());
+      if (c)
+      {
+        pl->close(c);
+        ws.setUserData(nullptr);
+        LOG(LogChannel::CONSOLE, LogLevel::INFO, "Disconnected");
+      }
+      return;
+    }
+    Session* session = static_cast<Session*>(ws.getUserData());
+    if (!session)
+    {
+      return;
+    }
+    state.closed(session);
+    delete session;
+    ws.setUserData(nullptr);
     ws.close();
-    std::cout << "Disconnected" << std::endl;
+    LOG(LogChannel::CONSOLE, LogLevel::INFO, "Disconnected");
   });
 
-  int port = 4567;
-  if (h.listen(port)) {
-    std::cout << "Listening to port " << port << std::endl;
+  int port = server.port;
+  int options = server.threads > 1 ? uS::ListenOptions::REUSE_PORT : 0;
+  if (h.listen(port, nullptr, options)) {
+    LOG(LogChannel::CONSOLE, LogLevel::INFO, "Listening to port {}", port);
   } else {
     std::cerr << "Failed to listen to port" << std::endl;
     return -1;
   }
-  
+
+  uv_timer_t timer;
+  bool watchdog = config.training && (server.watchdog.stall_timeout > 0 || server.watchdog.run_timeout > 0);
+  bool timer_needed = watchdog || config.measure_latency;
+  if (timer_needed && pl)
+  {
+    // the sessions are checked by the control thread
+    timer.data = pl;
+    uv_timer_init(h.getLoop(), &timer);
+    uv_timer_start(&timer, [](uv_timer_t* t) { static_cast<Pipelined*>(t->data)->tick(); }, WATCHDOG_PERIOD, WATCHDOG_PERIOD);
+  }
+  else if (timer_needed)
+  {
+    timer.data = &state;
+    uv_timer_init(h.getLoop(), &timer);
+    uv_timer_start(&timer, [](uv_timer_t* t) {
+      State* state = static_cast<State*>(t->data);
+      state->dump_latency();
+      std::vector<State::Connection> retry, hung;
+      state->check(retry, hung);
+      for (auto& c : retry)
+      {
+        size_t msglen = c.session->reply.reset();
+        c.ws.send(c.session->reply.data(), msglen, uWS::OpCode::TEXT);
+      }
+      // closing calls onDisconnection, which parks the trainer for the reconnecting simulator
+      for (auto& c : hung)
+      {
+        c.ws.close();
+      }
+      if (!hung.empty())
+      {
+        restart_simulator(state->watchdog);
+      }
+    }, WATCHDOG_PERIOD, WATCHDOG_PERIOD);
+  }
+
   h.run();
+  return 0;
 }
 
-#else 
-
 int main(int argc, char **argv) {
+  ServerConfig server;
+  SessionConfig config;
+  init(argc, argv, server, config);
 
-    PID pid;
-	PID pid_throttle;
+  return run_threads(server, [&server, &config] { return run_hub(server, config); });
+}
 
-	init(argc, argv, pid, pid_throttle);
+#else 
+
+// Run one uWS::App on the calling thread
+int run_app(const ServerConfig& server, const SessionConfig& config) {
 
 	struct PerSocketData {
-        int something;
+		Session* session;
+		void* connection;			// the PipelinedLoop::Connection in pipelined mode, instead of the session
 	};
+	typedef LoopState<uWS::WebSocket<false, true, PerSocketData>*> State;
+	State state(server.watchdog);
 
-	int port = 4567;
+	typedef PipelinedLoop<uWS::WebSocket<false, true, PerSocketData>*> Pipelined;
+	std::unique_ptr<Pipelined> pipelined;
+	if (server.pipeline)
+	{
+		pipelined.reset(new Pipelined(server.watchdog, config));
+		pipelined->send = [](auto* ws, const char* data, size_t length) { ws->send(std::string_view(data, length), uWS::OpCode::TEXT); };
+		pipelined->close_socket = [](auto* ws) { ws->close(); };
+		// Loop::defer() can be called from any thread, it wakes up the loop
+		uWS::Loop* loop = uWS::Loop::get();
+		Pipelined* target = pipelined.get();
+		int index = next_loop_index();
+		pipelined->start([loop, target] { loop->defer([target] { target->drain(); }); }, server.pipeline_cpu >= 0 ? server.pipeline_cpu + index : -1, server.coalesce);
+	}
+	Pipelined* pl = pipelined.get();
+
+	// coalescing without the pipeline: the messages are stored in the mailboxes of the sessions, and the latest ones are processed
+	// after all the messages received in the event loop iteration were dispatched
+	State* coalesced = (server.coalesce && !pl) ? &state : nullptr;
+	if (coalesced)
+	{
+		uWS::Loop::get()->addPostHandler(coalesced, [coalesced](uWS::Loop* /*loop*/) {
+			coalesced->process_pending([](auto* ws, const char* data, size_t length) {
+				ws->send(std::string_view(data, length), uWS::OpCode::TEXT);
+			});
+		});
+	}
+
+	int port = server.port;
 
 	uWS::App::WebSocketBehavior b;
     b.maxPayloadLength = 16 * 1024 * 1024;
-	b.open = [](auto* ws) {
-		std::cout << "Connected!!!" << std::endl;
+	b.open = [&config, &state, pl](auto* ws) {
+		if (pl)
+		{
+			static_cast<PerSocketData*>(ws->getUserData())->connection = pl->open(ws);
+			LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connected!!!");
+			return;
+		}
+		// every simulator gets its own controllers
+		Session* session = new Session(config);
+		static_cast<PerSocketData*>(ws->getUserData())->session = session;
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connected!!!");
+		bool resumed = bool(state.parked);
+		state.opened(ws, session);
+		if (resumed)
+		{
+			// the run is repeated from the start of the track
+			size_t msglen = session->reply.reset();
+			ws->send(std::string_view(session->reply.data(), msglen), uWS::OpCode::TEXT);
+		}
 	};
-	b.close = [](auto* ws, int /*code*/, std::string_view /*message*/) {
-		ws->close();
-		std::cout << "Disconnected" << std::endl;
+	b.close = [&state, pl](auto* ws, int /*code*/, std::string_view /*message*/) {
+		PerSocketData* psd = static_cast<PerSocketData*>(ws->getUserData());
+		if (pl)
+		{
+			pl->close(static_cast<Pipelined::Connection*>(psd->connection));
+			psd->connection = nullptr;
+			LOG(LogChannel::CONSOLE, LogLevel::INFO, "Disconnected");
+			return;
+		}
+		state.closed(psd->session);
+		delete psd->session;
+		psd->session = nullptr;
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Disconnected");
 	};
 
-
-    b.message = [&pid, &pid_throttle](auto* ws, std::string_view message, uWS::OpCode opCode) {
+    b.message = [pl, coalesced](auto* ws, std::string_view message, uWS::OpCode opCode) {
         // "42" at the start of the message means there's a websocket message event.
         // The 4 signifies a websocket message
         // The 2 signifies a websocket event
+		if (pl)
+		{
+			pl->message(static_cast<Pipelined::Connection*>(static_cast<PerSocketData*>(ws->getUserData())->connection), message.data(), message.length());
+			return;
+		}
+		Session* session = static_cast<PerSocketData*>(ws->getUserData())->session;
 		size_t length = message.length();
 		const char* data = message.data();
-		auto msg = process_message(data, length, pid, pid_throttle);
-		ws->send(msg, uWS::OpCode::TEXT);
+		if (coalesced)
+		{
+			coalesced->post(ws, session, data, length);
+			return;
+		}
+		auto msglen = process_message(data, length, *session);
+		if (msglen)
+		{
+			ws->send(std::string_view(session->reply.data(), msglen), uWS::OpCode::TEXT);
+			if (session->latency)
+			{
+				session->latency->sent();
+			}
+		}
     }; // end h.onMessage
 
-    uWS::App().ws<PerSocketData>("/*", std::move(b)).listen("127.0.0.1", port, [port](auto* listen_socket) {
+	bool watchdog = config.training && (server.watchdog.stall_timeout > 0 || server.watchdog.run_timeout > 0);
+	bool timer_needed = watchdog || config.measure_latency;
+	if (timer_needed && pl)
+	{
+		// the sessions are checked by the control thread
+		struct us_timer_t* timer = us_create_timer(reinterpret_cast<struct us_loop_t*>(uWS::Loop::get()), 0, sizeof(Pipelined*));
+		*static_cast<Pipelined**>(us_timer_ext(timer)) = pl;
+		us_timer_set(timer, [](struct us_timer_t* t) { (*static_cast<Pipelined**>(us_timer_ext(t)))->tick(); }, WATCHDOG_PERIOD, WATCHDOG_PERIOD);
+	}
+	else if (timer_needed)
+	{
+		struct us_timer_t* timer = us_create_timer(reinterpret_cast<struct us_loop_t*>(uWS::Loop::get()), 0, sizeof(State*));
+		*static_cast<State**>(us_timer_ext(timer)) = &state;
+		us_timer_set(timer, [](struct us_timer_t* t) {
+			State* state = *static_cast<State**>(us_timer_ext(t));
+			state->dump_latency();
+			std::vector<State::Connection> retry, hung;
+			state->check(retry, hung);
+			for (auto& c : retry)
+			{
+				size_t msglen = c.session->reply.reset();
+				c.ws->send(std::string_view(c.session->reply.data(), msglen), uWS::OpCode::TEXT);
+			}
+			// closing calls the close handler, which parks the trainer for the reconnecting simulator
+			for (auto& c : hung)
+			{
+				c.ws->close();
+			}
+			if (!hung.empty())
+			{
+				restart_simulator(state->watchdog);
+			}
+		}, WATCHDOG_PERIOD, WATCHDOG_PERIOD);
+	}
+
+	// the listening sockets of uSockets are created with SO_REUSEPORT, so every thread can listen on the same port
+	bool listening = false;
+    uWS::App().ws<PerSocketData>("/*", std::move(b)).listen("127.0.0.1", port, [port, &listening](auto* listen_socket) {
         if (listen_socket) {
-            std::cout << "Listening on port " << port << std::endl;
+            LOG(LogChannel::CONSOLE, LogLevel::INFO, "Listening on port {}", port);
+            listening = true;
         }
         else {
             std::cerr << "Failed to listen to port" << std::endl;
-            exit(-1);
         }
     }).run();
 
+	return listening ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+
+	ServerConfig server;
+	SessionConfig config;
+	init(argc, argv, server, config);
+
+	return run_threads(server, [&server, &config] { return run_app(server, config); });
 }
 
 #endif 
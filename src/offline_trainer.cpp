@@ -0,0 +1,142 @@
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include "offline_trainer.h"
+#include "logger.h"
+
+void drive_run(VehicleSim& sim, PID& pid, PID& pid_throttle, double optimal_speed, int samples, double offset)
+{
+	sim.reset(offset);
+	for (int i = 0; i < samples; i++)
+	{
+		Telemetry t = sim.telemetry();
+		double steer_value, throttle;
+		// the measured timing gets the time step of the simulator
+		logic(pid, pid_throttle, optimal_speed, t.cte, t.speed, t.angle, steer_value, throttle, 1, sim.step_time());
+		if (pid.GetStopReason() != StopReason::NONE)
+			break;
+		sim.step(steer_value, throttle);
+	}
+}
+
+int train_offline(Session& session, VehicleSim& sim, const OfflineConfig& config)
+{
+	PIDTRAINER& trainer = *session.trainer;
+	int runs = 0;
+	// a resumed training continues until the total number of its runs reaches max_runs
+	while (trainer.runs < config.max_runs)
+	{
+		// the throttle controller is restarted too, so every run is the same apart from the steering parameters
+		session.pid_throttle.Init(999999, 0, 0);
+		drive_run(sim, session.pid, session.pid_throttle, session.optimal_speed, trainer.target_samplenum, config.offset);
+		runs++;
+
+		// evaluates the run, and initializes the pid with the next parameters to try
+		trainer.ready();
+		session.pid.samplenum = 0;
+
+		if (trainer.optimizer->step_size() < config.tolerance)
+			break;
+	}
+	return runs;
+}
+
+// ParallelTwiddle
+
+ParallelTwiddle::ParallelTwiddle(const SessionConfig& _config, const Track& _track, int threads, int _scales)
+	: config(_config), track(_track), pool(threads)
+{
+	scales = _scales > 0 ? _scales : (pool.size() + 5) / 6;
+	scales = std::min(scales, int(MAX_SCALES));
+	for (int i = 0; i < 3; i++)
+	{
+		params[i] = config.params[i];
+		deltas[i] = config.deltas[i];
+	}
+	best_err = 0;
+}
+
+double ParallelTwiddle::scale_factor(int scale)
+{
+	if (scale == 0)
+		return 1;
+	int exponent = (scale + 1) / 2;
+	return ldexp(1.0, scale % 2 ? exponent : -exponent);
+}
+
+double ParallelTwiddle::evaluate(const double p[3], VehicleSim& sim, double offset, double limit) const
+{
+	PID pid, pid_throttle;
+	pid.Set_Train_SampleLen(config.train_samplenum);
+	pid.SetEarlyStop(config.early_stop);
+	pid.SetCostTerms(config.cost_terms);
+	pid.SetObjective(config.objective);
+	pid.SetScoreWindow(config.score_window);
+	pid.SetTiming(config.timing);
+	pid_throttle.SetTiming(config.timing);
+	pid.Init(p[0], p[1], p[2]);
+	pid.SetCostLimit(limit);
+	pid_throttle.Init(999999, 0, 0);
+	drive_run(sim, pid, pid_throttle, config.optimal_speed, config.train_samplenum, offset);
+	return pid.GetCostValue();
+}
+
+int ParallelTwiddle::train(const OfflineConfig& offline)
+{
+	// every worker has its own simulator
+	std::vector<std::unique_ptr<VehicleSim>> sims;
+	for (int i = 0; i < pool.size(); i++)
+		sims.emplace_back(new VehicleSim(track));
+
+	best_err = evaluate(params, *sims[0], offline.offset, 0);
+	int runs = 1;
+	LOG(LogChannel::TRAINING, LogLevel::INFO, "START Best err: {} Params: {} {} {} {} {} {}", best_err, params[0], params[1], params[2], deltas[0], deltas[1], deltas[2]);
+
+	// probe 6*k+2*i is params[i] + step, probe 6*k+2*i+1 is params[i] - step, where step is deltas[i] at the scale k
+	const int PROBES = 6 * scales;
+	std::vector<double> errs(PROBES);
+	while (runs + PROBES <= offline.max_runs && deltas[0] + deltas[1] + deltas[2] >= offline.tolerance)
+	{
+		pool.run(PROBES, [this, &sims, &errs, &offline](int probe, int worker) {
+			double p[3] = { params[0], params[1], params[2] };
+			int idx = probe % 6 / 2;
+			double step = deltas[idx] * scale_factor(probe / 6);
+			p[idx] += (probe % 2 == 0) ? step : -step;
+			errs[probe] = evaluate(p, *sims[worker], offline.offset, best_err);
+		});
+		runs += PROBES;
+
+		int best = -1;
+		for (int probe = 0; probe < PROBES; probe++)
+		{
+			if (errs[probe] < (best < 0 ? best_err : errs[best]))
+				best = probe;
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			if (best >= 0 && best % 6 / 2 == i)
+			{
+				double step = deltas[i] * scale_factor(best / 6);
+				params[i] += (best % 2 == 0) ? step : -step;
+				deltas[i] = step * 1.1;
+				continue;
+			}
+			bool improved = false;
+			for (int k = 0; k < scales; k++)
+			{
+				if (errs[6 * k + 2 * i] < best_err || errs[6 * k + 2 * i + 1] < best_err)
+					improved = true;
+			}
+			if (!improved)
+			{
+				deltas[i] *= 0.9;
+			}
+		}
+		if (best >= 0)
+		{
+			best_err = errs[best];
+			LOG(LogChannel::TRAINING, LogLevel::INFO, "NEW Best was born: {} Params: {} {} {} {} {} {}", best_err, params[0], params[1], params[2], deltas[0], deltas[1], deltas[2]);
+		}
+	}
+	return runs;
+}
@@ -0,0 +1,84 @@
+#ifndef OFFLINE_TRAINER_H
+#define OFFLINE_TRAINER_H
+#include "PID.h"
+#include "simulator.h"
+#include "session.h"
+#include "worker_pool.h"
+
+// The settings of the offline training
+struct OfflineConfig {
+	int max_runs = 1000;		// stop after this many simulation runs
+	double tolerance = 0;		// stop if the step size of the optimizer ( the sum of the twiddle deltas ) is smaller than this
+	double offset = 0;			// the initial distance of the car from the center line in every run (meters)
+};
+
+/**
+* Drive one simulation run from the start of the track with the given controllers
+* @param sim The simulator, it is reset at the beginning
+* @param pid, pid_throttle The steering and throttle controllers, the cost value is accumulated in pid
+* @param optimal_speed The target speed of the throttle controller
+* @param samples The length of the run. It's shorter if pid stops it early ( @see EarlyStopConfig )
+* @param offset The initial distance of the car from the center line
+*/
+void drive_run(VehicleSim& sim, PID& pid, PID& pid_throttle, double optimal_speed, int samples, double offset);
+
+/**
+* Train the steering controller of a session with its PIDTRAINER, against the simulator in a tight loop, without any networking.
+* This executes the same optimizer ( PIDTRAINER::ready() ) as the pid application, after each run.
+* @param session A session created in training mode
+* @param sim The simulator to drive
+* @param config The stop conditions of the training
+* @output The number of simulation runs executed ( in this call, without the runs before a resumed checkpoint )
+*/
+int train_offline(Session& session, VehicleSim& sim, const OfflineConfig& config);
+
+// ParallelTwiddle class:
+//   A parallel variant of the twiddle algorithm of PIDTRAINER for the offline training.
+//   In every round the +delta and -delta probes of all the 3 parameters are evaluated concurrently on a WorkerPool, each with its
+//   own PID controllers and VehicleSim, at a number of step scales: delta * 1, 2, 0.5, 4, 0.25, ... ( 6 runs per scale ).
+//   Then the best improving probe is accepted, and the delta of its parameter becomes its step increased by 10%,
+//   and the deltas of the parameters with no improving probe are decreased by 10%. With one scale this is the round of 6 probes
+//   of the plain parallel twiddle, the further scales keep more threads busy with speculative steps.
+//   The results are merged in probe order, so the outcome depends on the number of scales, but not on the number of threads.
+class ParallelTwiddle {
+
+public:
+	/**
+	* Construct the trainer
+	* @param _config The initial parameters, deltas, run length and target speed ( as in training mode )
+	* @param _track The track to drive on in all the simulators
+	* @param threads The number of worker threads, 0 means one per CPU core
+	* @param _scales The number of step scales in a round, 1 to MAX_SCALES. 0 means enough for all the threads ( threads / 6, rounded up,
+	*		at most MAX_SCALES ), the larger values are clamped to MAX_SCALES
+	*/
+	ParallelTwiddle(const SessionConfig& _config, const Track& _track, int threads = 0, int _scales = 0);
+
+	/**
+	* Execute the training
+	* @param offline The stop conditions. ( max_runs counts every probe )
+	* @output The number of simulation runs executed
+	*/
+	int train(const OfflineConfig& offline);
+
+	// the current parameters and deltas, and the lowest cost value
+	double params[3];
+	double deltas[3];
+	double best_err;
+
+	// the number of step scales in a round ( 6 probes each ), and its maximum: the further scales would be steps of delta * 32 or more
+	int scales;
+	static const int MAX_SCALES = 8;
+
+private:
+	// The multiplier of the deltas at a step scale: 1, 2, 0.5, 4, 0.25, ...
+	static double scale_factor(int scale);
+
+	// Evaluate a parameter set in a simulator of a worker. limit is the cost value of the best run, for the early stop rules ( 0 = none )
+	double evaluate(const double p[3], VehicleSim& sim, double offset, double limit) const;
+
+	SessionConfig config;
+	const Track& track;
+	WorkerPool pool;
+};
+
+#endif  // OFFLINE_TRAINER_H
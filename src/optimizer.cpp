@@ -0,0 +1,640 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include "optimizer.h"
+
+std::unique_ptr<Optimizer> make_optimizer(OptimizerKind kind, const double params[3], const double deltas[3])
+{
+	std::unique_ptr<Optimizer> optimizer;
+	switch (kind) {
+	case OptimizerKind::TWIDDLE:
+		optimizer.reset(new Twiddle(params, deltas));
+		break;
+	case OptimizerKind::NELDER_MEAD:
+		optimizer.reset(new NelderMead(params, deltas));
+		break;
+	case OptimizerKind::COORDINATE:
+		optimizer.reset(new CoordinateDescent(params, deltas));
+		break;
+	case OptimizerKind::CMAES:
+		optimizer.reset(new CMAES(params, deltas));
+		break;
+	}
+	return optimizer;
+}
+
+bool parse_optimizer(const char* name, OptimizerKind& kind)
+{
+	static const struct {
+		const char* name;
+		OptimizerKind kind;
+	} names[] = {
+		{ "twiddle", OptimizerKind::TWIDDLE },
+		{ "nelder-mead", OptimizerKind::NELDER_MEAD },
+		{ "coordinate", OptimizerKind::COORDINATE },
+		{ "cmaes", OptimizerKind::CMAES },
+	};
+	for (const auto& n : names)
+	{
+		if (strcmp(name, n.name) == 0)
+		{
+			kind = n.kind;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Twiddle
+
+Twiddle::Twiddle(const double _params[3], const double _deltas[3])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		params[i] = _params[i];
+		deltas[i] = _deltas[i];
+	}
+	curstate = START;
+	curparamidx = 0;
+	best_err = 0;
+}
+
+void Twiddle::ask(double p[3])
+{
+	p[0] = params[0];
+	p[1] = params[1];
+	p[2] = params[2];
+}
+
+// try the next parameter, increased with its delta
+void Twiddle::next_param()
+{
+	curparamidx = (curparamidx + 1) % 3;
+	params[curparamidx] += deltas[curparamidx];
+	curstate = PARAMINCREASED;
+}
+
+void Twiddle::tell(double err)
+{
+	switch (curstate) {
+	case START:
+		best_err = err;
+		curparamidx = 0;
+		params[curparamidx] += deltas[curparamidx];
+		curstate = PARAMINCREASED;
+		break;
+	case PARAMINCREASED:
+		if (err < best_err)
+		{
+			best_err = err;
+			deltas[curparamidx] *= 1.1;
+			next_param();
+		}
+		else
+		{
+			params[curparamidx] -= 2 * deltas[curparamidx];
+			curstate = PARAMDECREASED;
+		}
+		break;
+	case PARAMDECREASED:
+		if (err < best_err)
+		{
+			best_err = err;
+			deltas[curparamidx] *= 1.1;
+		}
+		else
+		{
+			params[curparamidx] += deltas[curparamidx];
+			deltas[curparamidx] *= 0.9;
+		}
+		next_param();
+		break;
+	}
+}
+
+void Twiddle::save(StateWriter& w) const
+{
+	w.put(params);
+	w.put(deltas);
+	w.put(curstate);
+	w.put(curparamidx);
+	w.put(best_err);
+}
+
+void Twiddle::restore(StateReader& r)
+{
+	r.get(params);
+	r.get(deltas);
+	r.get(curstate);
+	r.get(curparamidx);
+	r.get(best_err);
+}
+
+// NelderMead
+
+NelderMead::NelderMead(const double params[3], const double deltas[3])
+{
+	for (int k = 0; k < 4; k++)
+	{
+		for (int i = 0; i < 3; i++)
+			simplex[k][i] = params[i];
+		if (k > 0)
+			simplex[k][k - 1] += deltas[k - 1];
+		values[k] = 0;
+	}
+	state = INIT;
+	vertex = 0;
+	memcpy(candidate, simplex[0], sizeof(candidate));
+	reflected_err = 0;
+}
+
+void NelderMead::ask(double p[3])
+{
+	memcpy(p, candidate, sizeof(candidate));
+}
+
+double NelderMead::step_size() const
+{
+	// the extent of the simplex along the axes
+	double size = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		double lo = simplex[0][i], hi = simplex[0][i];
+		for (int k = 1; k < 4; k++)
+		{
+			lo = std::min(lo, simplex[k][i]);
+			hi = std::max(hi, simplex[k][i]);
+		}
+		size += hi - lo;
+	}
+	return size;
+}
+
+void NelderMead::along(const double from[3], double t, double x[3]) const
+{
+	for (int i = 0; i < 3; i++)
+		x[i] = centroid[i] + t * (from[i] - centroid[i]);
+}
+
+void NelderMead::replace_worst(const double x[3], double err)
+{
+	memcpy(simplex[3], x, sizeof(simplex[3]));
+	values[3] = err;
+}
+
+void NelderMead::start_iteration()
+{
+	// sort the vertices by their cost value ( insertion sort, stable )
+	for (int k = 1; k < 4; k++)
+	{
+		for (int j = k; j > 0 && values[j] < values[j - 1]; j--)
+		{
+			std::swap(values[j], values[j - 1]);
+			for (int i = 0; i < 3; i++)
+				std::swap(simplex[j][i], simplex[j - 1][i]);
+		}
+	}
+	for (int i = 0; i < 3; i++)
+		centroid[i] = (simplex[0][i] + simplex[1][i] + simplex[2][i]) / 3;
+	along(simplex[3], -1, candidate);
+	state = REFLECT;
+}
+
+void NelderMead::tell(double err)
+{
+	switch (state) {
+	case INIT:
+	case SHRINK:
+		values[vertex++] = err;
+		if (vertex < 4)
+			memcpy(candidate, simplex[vertex], sizeof(candidate));
+		else
+			start_iteration();
+		break;
+	case REFLECT:
+		memcpy(reflected, candidate, sizeof(reflected));
+		reflected_err = err;
+		if (err < values[0])
+		{
+			along(simplex[3], -2, candidate);
+			state = EXPAND;
+		}
+		else if (err < values[2])
+		{
+			replace_worst(reflected, err);
+			start_iteration();
+		}
+		else
+		{
+			// outside contraction if the reflected point is better than the worst one, inside contraction otherwise
+			along(err < values[3] ? reflected : simplex[3], 0.5, candidate);
+			state = CONTRACT;
+		}
+		break;
+	case EXPAND:
+		if (err < reflected_err)
+			replace_worst(candidate, err);
+		else
+			replace_worst(reflected, reflected_err);
+		start_iteration();
+		break;
+	case CONTRACT:
+		if (err < std::min(reflected_err, values[3]))
+		{
+			replace_worst(candidate, err);
+			start_iteration();
+		}
+		else
+		{
+			// shrink the simplex toward the best vertex, and evaluate the moved vertices
+			for (int k = 1; k < 4; k++)
+			{
+				for (int i = 0; i < 3; i++)
+					simplex[k][i] = simplex[0][i] + 0.5 * (simplex[k][i] - simplex[0][i]);
+			}
+			vertex = 1;
+			memcpy(candidate, simplex[1], sizeof(candidate));
+			state = SHRINK;
+		}
+		break;
+	}
+}
+
+void NelderMead::save(StateWriter& w) const
+{
+	w.put(state);
+	w.put(simplex);
+	w.put(values);
+	w.put(vertex);
+	w.put(centroid);
+	w.put(reflected);
+	w.put(reflected_err);
+	w.put(candidate);
+}
+
+void NelderMead::restore(StateReader& r)
+{
+	r.get(state);
+	r.get(simplex);
+	r.get(values);
+	r.get(vertex);
+	r.get(centroid);
+	r.get(reflected);
+	r.get(reflected_err);
+	r.get(candidate);
+}
+
+// CoordinateDescent
+
+CoordinateDescent::CoordinateDescent(const double params[3], const double deltas[3])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		best[i] = params[i];
+		this->deltas[i] = deltas[i];
+	}
+	memcpy(candidate, best, sizeof(candidate));
+	state = START;
+	idx = 0;
+	best_err = plus_err = step = 0;
+}
+
+void CoordinateDescent::ask(double p[3])
+{
+	memcpy(p, candidate, sizeof(candidate));
+}
+
+void CoordinateDescent::probe(double offset)
+{
+	memcpy(candidate, best, sizeof(candidate));
+	candidate[idx] += offset;
+}
+
+void CoordinateDescent::next_param()
+{
+	idx = (idx + 1) % 3;
+	probe(deltas[idx]);
+	state = PLUS;
+}
+
+void CoordinateDescent::tell(double err)
+{
+	switch (state) {
+	case START:
+		best_err = err;
+		idx = 0;
+		probe(deltas[idx]);
+		state = PLUS;
+		break;
+	case PLUS:
+	case MINUS:
+		if (err < best_err)
+		{
+			// improved: continue in this direction with a doubled step
+			best[idx] = candidate[idx];
+			best_err = err;
+			step = 2 * (state == PLUS ? deltas[idx] : -deltas[idx]);
+			probe(step);
+			state = EXTEND;
+		}
+		else if (state == PLUS)
+		{
+			plus_err = err;
+			probe(-deltas[idx]);
+			state = MINUS;
+		}
+		else
+		{
+			// the minimum is between the two probes: try the vertex of the parabola through the 3 points
+			double curvature = plus_err - 2 * best_err + err;
+			deltas[idx] *= 0.5;
+			if (curvature > 0)
+			{
+				probe(2 * deltas[idx] * (err - plus_err) / (2 * curvature));
+				state = PARABOLA;
+			}
+			else
+			{
+				next_param();
+			}
+		}
+		break;
+	case EXTEND:
+		if (err < best_err)
+		{
+			best[idx] = candidate[idx];
+			best_err = err;
+			step *= 2;
+			probe(step);
+		}
+		else
+		{
+			// the last successful step is the delta of the next search along this axis
+			deltas[idx] = fabs(step) / 2;
+			next_param();
+		}
+		break;
+	case PARABOLA:
+		if (err < best_err)
+		{
+			best[idx] = candidate[idx];
+			best_err = err;
+		}
+		next_param();
+		break;
+	}
+}
+
+void CoordinateDescent::save(StateWriter& w) const
+{
+	w.put(state);
+	w.put(best);
+	w.put(best_err);
+	w.put(deltas);
+	w.put(candidate);
+	w.put(idx);
+	w.put(plus_err);
+	w.put(step);
+}
+
+void CoordinateDescent::restore(StateReader& r)
+{
+	r.get(state);
+	r.get(best);
+	r.get(best_err);
+	r.get(deltas);
+	r.get(candidate);
+	r.get(idx);
+	r.get(plus_err);
+	r.get(step);
+}
+
+// CMAES
+
+CMAES::CMAES(const double params[3], const double deltas[3], unsigned int _seed)
+{
+	seed = _seed;
+	for (int i = 0; i < N; i++)
+	{
+		scale[i] = deltas[i] != 0 ? deltas[i] : 1;
+		mean[i] = params[i] / scale[i];
+		pc[i] = ps[i] = 0;
+		for (int j = 0; j < N; j++)
+			C[i][j] = B[i][j] = (i == j) ? 1 : 0;
+		D[i] = 1;
+	}
+	sigma = 1;
+
+	// the default strategy parameters ( Hansen: The CMA Evolution Strategy: A Tutorial )
+	double sum = 0, sum2 = 0;
+	for (int i = 0; i < MU; i++)
+	{
+		weights[i] = log(MU + 0.5) - log(i + 1.0);
+		sum += weights[i];
+	}
+	for (int i = 0; i < MU; i++)
+	{
+		weights[i] /= sum;
+		sum2 += weights[i] * weights[i];
+	}
+	mueff = 1 / sum2;
+	cc = (4 + mueff / N) / (N + 4 + 2 * mueff / N);
+	cs = (mueff + 2) / (N + mueff + 5);
+	c1 = 2 / ((N + 1.3) * (N + 1.3) + mueff);
+	cmu = std::min(1 - c1, 2 * (mueff - 2 + 1 / mueff) / ((N + 2) * (N + 2) + mueff));
+	damps = 1 + 2 * std::max(0.0, sqrt((mueff - 1) / (N + 1)) - 1) + cs;
+	chiN = sqrt(double(N)) * (1 - 1.0 / (4 * N) + 1.0 / (21 * N * N));
+
+	generation = 0;
+	current = 0;
+	sample();
+}
+
+void CMAES::sample()
+{
+	std::seed_seq seq = { seed, unsigned(generation) };
+	std::mt19937 rng(seq);
+	std::normal_distribution<double> normal;
+	for (int k = 0; k < LAMBDA; k++)
+	{
+		double z[N];
+		for (int i = 0; i < N; i++)
+			z[i] = D[i] * normal(rng);
+		for (int i = 0; i < N; i++)
+		{
+			ys[k][i] = 0;
+			for (int j = 0; j < N; j++)
+				ys[k][i] += B[i][j] * z[j];
+		}
+	}
+}
+
+void CMAES::ask(double p[3])
+{
+	for (int i = 0; i < N; i++)
+		p[i] = (mean[i] + sigma * ys[current][i]) * scale[i];
+}
+
+void CMAES::tell(double err)
+{
+	errs[current++] = err;
+	if (current == LAMBDA)
+	{
+		update();
+		current = 0;
+		sample();
+	}
+}
+
+double CMAES::step_size() const
+{
+	double size = 0;
+	for (int i = 0; i < N; i++)
+		size += sigma * sqrt(C[i][i]) * fabs(scale[i]);
+	return size;
+}
+
+void CMAES::update()
+{
+	int order[LAMBDA];
+	for (int k = 0; k < LAMBDA; k++)
+		order[k] = k;
+	std::stable_sort(order, order + LAMBDA, [this](int a, int b) { return errs[a] < errs[b]; });
+
+	// the weighted mean of the selected steps moves the mean
+	double yw[N] = { 0, 0, 0 };
+	for (int k = 0; k < MU; k++)
+	{
+		for (int i = 0; i < N; i++)
+			yw[i] += weights[k] * ys[order[k]][i];
+	}
+	for (int i = 0; i < N; i++)
+		mean[i] += sigma * yw[i];
+
+	// C^-1/2 * yw = B * D^-1 * B' * yw
+	double t[N], cy[N];
+	for (int i = 0; i < N; i++)
+	{
+		t[i] = 0;
+		for (int j = 0; j < N; j++)
+			t[i] += B[j][i] * yw[j];
+		t[i] /= D[i];
+	}
+	double psnorm = 0;
+	for (int i = 0; i < N; i++)
+	{
+		cy[i] = 0;
+		for (int j = 0; j < N; j++)
+			cy[i] += B[i][j] * t[j];
+		ps[i] = (1 - cs) * ps[i] + sqrt(cs * (2 - cs) * mueff) * cy[i];
+		psnorm += ps[i] * ps[i];
+	}
+	psnorm = sqrt(psnorm);
+	generation++;
+	bool hsig = psnorm / sqrt(1 - pow(1 - cs, 2.0 * generation)) / chiN < 1.4 + 2.0 / (N + 1);
+	for (int i = 0; i < N; i++)
+		pc[i] = (1 - cc) * pc[i] + (hsig ? sqrt(cc * (2 - cc) * mueff) : 0) * yw[i];
+
+	// rank-one and rank-mu update of the covariance matrix
+	for (int i = 0; i < N; i++)
+	{
+		for (int j = 0; j < N; j++)
+		{
+			double rankmu = 0;
+			for (int k = 0; k < MU; k++)
+				rankmu += weights[k] * ys[order[k]][i] * ys[order[k]][j];
+			C[i][j] = (1 - c1 - cmu) * C[i][j]
+				+ c1 * (pc[i] * pc[j] + (hsig ? 0 : cc * (2 - cc) * C[i][j]))
+				+ cmu * rankmu;
+		}
+	}
+	sigma *= exp(cs / damps * (psnorm / chiN - 1));
+	decompose();
+}
+
+void CMAES::decompose()
+{
+	// cyclic Jacobi rotations on a copy of C, the rotations are accumulated in B
+	double A[N][N];
+	for (int i = 0; i < N; i++)
+	{
+		for (int j = 0; j < N; j++)
+		{
+			A[i][j] = C[i][j];
+			B[i][j] = (i == j) ? 1 : 0;
+		}
+	}
+	for (int sweep = 0; sweep < 50; sweep++)
+	{
+		double off = A[0][1] * A[0][1] + A[0][2] * A[0][2] + A[1][2] * A[1][2];
+		if (off < 1e-30)
+			break;
+		for (int p = 0; p < N - 1; p++)
+		{
+			for (int q = p + 1; q < N; q++)
+			{
+				if (A[p][q] == 0)
+					continue;
+				double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+				double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+				double c = 1 / sqrt(t * t + 1), s = t * c;
+				for (int k = 0; k < N; k++)
+				{
+					double akp = A[k][p], akq = A[k][q];
+					A[k][p] = c * akp - s * akq;
+					A[k][q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < N; k++)
+				{
+					double apk = A[p][k], aqk = A[q][k];
+					A[p][k] = c * apk - s * aqk;
+					A[q][k] = s * apk + c * aqk;
+				}
+				for (int k = 0; k < N; k++)
+				{
+					double bkp = B[k][p], bkq = B[k][q];
+					B[k][p] = c * bkp - s * bkq;
+					B[k][q] = s * bkp + c * bkq;
+				}
+			}
+		}
+	}
+	for (int i = 0; i < N; i++)
+		D[i] = sqrt(std::max(A[i][i], 1e-20));
+}
+
+void CMAES::save(StateWriter& w) const
+{
+	// the strategy parameters and the scale are derived from the constructor arguments
+	w.put(scale);
+	w.put(mean);
+	w.put(sigma);
+	w.put(C);
+	w.put(B);
+	w.put(D);
+	w.put(pc);
+	w.put(ps);
+	w.put(ys);
+	w.put(errs);
+	w.put(current);
+	w.put(generation);
+	w.put(seed);
+}
+
+void CMAES::restore(StateReader& r)
+{
+	r.get(scale);
+	r.get(mean);
+	r.get(sigma);
+	r.get(C);
+	r.get(B);
+	r.get(D);
+	r.get(pc);
+	r.get(ps);
+	r.get(ys);
+	r.get(errs);
+	r.get(current);
+	r.get(generation);
+	r.get(seed);
+}
@@ -0,0 +1,205 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+#include <memory>
+#include "checkpoint.h"
+
+// The available hyperparameter optimization algorithms of PIDTRAINER
+enum class OptimizerKind {
+	TWIDDLE,
+	NELDER_MEAD,
+	COORDINATE,
+	CMAES,
+};
+
+// Optimizer class:
+//   The interface of the optimization algorithms which search the P, I, D coefficients with the lowest cost value.
+//   It's an ask/tell interface: ask() gives the next parameter set to evaluate, and the cost value of that simulation run is passed
+//   back with tell(). The two calls must alternate, starting with ask(), so the algorithm can run asynchronously, between
+//   the simulation runs of the PIDTRAINER.
+class Optimizer {
+
+public:
+	virtual ~Optimizer() {}
+
+	/**
+	* Get the next parameter set to evaluate
+	* @param p The P, I, D coefficients are written here
+	*/
+	virtual void ask(double p[3]) = 0;
+
+	/**
+	* Report the result of the evaluation of the last asked parameter set
+	* @param err The cost value of the simulation run
+	*/
+	virtual void tell(double err) = 0;
+
+	// The size of the current search steps, summed for the 3 parameters. The training can be stopped when it gets small enough.
+	virtual double step_size() const = 0;
+
+	// The algorithm of the optimizer
+	virtual OptimizerKind kind() const = 0;
+
+	// Save and restore the whole state of the algorithm, for the checkpoints of the PIDTRAINER.
+	// After restore() the optimizer continues exactly as the saved one would have, so ask() gives the same parameter set again.
+	virtual void save(StateWriter& w) const = 0;
+	virtual void restore(StateReader& r) = 0;
+};
+
+/**
+* Create an optimizer
+* @param kind The algorithm
+* @param params The initial P, I, D coefficients
+* @param deltas The initial step sizes of the 3 parameters ( they also set the scale of the parameters for the algorithms )
+*/
+std::unique_ptr<Optimizer> make_optimizer(OptimizerKind kind, const double params[3], const double deltas[3]);
+
+// Parse an optimizer name ( twiddle, nelder-mead, coordinate or cmaes ). Returns false if it's unknown.
+bool parse_optimizer(const char* name, OptimizerKind& kind);
+
+// Twiddle class:
+//   The twiddle algorithm: the parameters are tuned one after the other with +delta, then -delta probes.
+//   An improving probe is accepted and its delta is increased by 10%, otherwise the delta is decreased by 10%. (@see notes.md)
+class Twiddle : public Optimizer {
+
+public:
+	Twiddle(const double _params[3], const double _deltas[3]);
+	void ask(double p[3]) override;
+	void tell(double err) override;
+	double step_size() const override { return deltas[0] + deltas[1] + deltas[2]; }
+	OptimizerKind kind() const override { return OptimizerKind::TWIDDLE; }
+	void save(StateWriter& w) const override;
+	void restore(StateReader& r) override;
+
+	double params[3];			// the parameter set under evaluation
+	double deltas[3];
+
+private:
+	void next_param();
+
+	enum {
+		START,
+		PARAMINCREASED,
+		PARAMDECREASED,
+	} curstate;
+	int curparamidx;
+	double best_err;
+};
+
+// NelderMead class:
+//   The Nelder-Mead downhill simplex method. The simplex has 4 vertices in the 3 dimensional parameter space, the initial one
+//   is the initial parameter set with one delta step along each axis. It adapts its shape to the cost function, so it handles the
+//   correlated parameters ( e.g. P and D ) better than the axis-by-axis search of twiddle.
+class NelderMead : public Optimizer {
+
+public:
+	NelderMead(const double params[3], const double deltas[3]);
+	void ask(double p[3]) override;
+	void tell(double err) override;
+	double step_size() const override;
+	OptimizerKind kind() const override { return OptimizerKind::NELDER_MEAD; }
+	void save(StateWriter& w) const override;
+	void restore(StateReader& r) override;
+
+private:
+	// sort the simplex, and reflect the worst vertex through the centroid of the others
+	void start_iteration();
+	// x = centroid + t * ( from - centroid )
+	void along(const double from[3], double t, double x[3]) const;
+	void replace_worst(const double x[3], double err);
+
+	enum {
+		INIT,
+		REFLECT,
+		EXPAND,
+		CONTRACT,
+		SHRINK,
+	} state;
+	double simplex[4][3];
+	double values[4];
+	int vertex;					// the vertex under evaluation in the INIT and SHRINK states
+	double centroid[3];
+	double reflected[3];
+	double reflected_err;
+	double candidate[3];
+};
+
+// CoordinateDescent class:
+//   Line searches along the parameter axes, one after the other. Along an axis the +delta and -delta probes are tried first,
+//   if one of them improves, the step is doubled while it improves further. If neither of them improves, the minimum of the
+//   parabola fitted on the 3 points is tried, and the delta is halved.
+class CoordinateDescent : public Optimizer {
+
+public:
+	CoordinateDescent(const double params[3], const double deltas[3]);
+	void ask(double p[3]) override;
+	void tell(double err) override;
+	double step_size() const override { return deltas[0] + deltas[1] + deltas[2]; }
+	OptimizerKind kind() const override { return OptimizerKind::COORDINATE; }
+	void save(StateWriter& w) const override;
+	void restore(StateReader& r) override;
+
+private:
+	void probe(double offset);
+	void next_param();
+
+	enum {
+		START,
+		PLUS,
+		MINUS,
+		EXTEND,
+		PARABOLA,
+	} state;
+	double best[3];
+	double best_err;
+	double deltas[3];
+	double candidate[3];
+	int idx;					// the index of the parameter under search
+	double plus_err;			// the cost value of the +delta probe
+	double step;				// the current step of the extension ( signed )
+};
+
+// CMAES class:
+//   The Covariance Matrix Adaptation Evolution Strategy. Every generation samples 7 parameter sets from a multivariate normal
+//   distribution, and moves its mean toward the best 3 of them, while it adapts the covariance matrix and the step size to the
+//   successful steps. The parameters are normalized by the initial deltas, so the initial distribution has a standard deviation of
+//   one delta along each axis. The random generator of every generation is seeded from the seed and the generation number, so the
+//   training is repeatable, and it's also repeated exactly after the restore of a checkpoint.
+class CMAES : public Optimizer {
+
+public:
+	CMAES(const double params[3], const double deltas[3], unsigned int seed = 1);
+	void ask(double p[3]) override;
+	void tell(double err) override;
+	double step_size() const override;
+	OptimizerKind kind() const override { return OptimizerKind::CMAES; }
+	void save(StateWriter& w) const override;
+	void restore(StateReader& r) override;
+
+	static const int N = 3;
+	static const int LAMBDA = 7;	// the population size: 4 + 3 * ln(N)
+	static const int MU = 3;		// the number of the selected parameter sets
+
+private:
+	void sample();
+	void update();
+	// The eigendecomposition of the covariance matrix: C = B * diag(D^2) * B'
+	void decompose();
+
+	double scale[N];				// the normalization of the parameters
+	double mean[N];
+	double sigma;
+	double C[N][N];
+	double B[N][N];
+	double D[N];
+	double pc[N], ps[N];			// the evolution paths
+	double weights[MU];
+	double mueff, cc, cs, c1, cmu, damps, chiN;
+
+	double ys[LAMBDA][N];			// the sampled steps of the generation: x = mean + sigma * y
+	double errs[LAMBDA];
+	int current;					// the index of the parameter set under evaluation in the generation
+	int generation;
+	unsigned int seed;
+};
+
+#endif  // OPTIMIZER_H
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include "pid_batch.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#define PID_BATCH_X86
+	#include <immintrin.h>
+#endif
+
+// The kernels calculate out[i] = -p - i - d for every gain set, with the same operations in the same order as PID::UpdateError() and
+// PID::TotalError(), so the results are bit-identical:
+//   p = Kp * cte,  d = Kd * diff / dt,  i = Ki * sum * dt
+typedef void (*BatchKernel)(const double* kp, const double* ki, const double* kd, double* out, int n, double cte, double diff, bool first, double sum, double dt);
+
+static void kernel_scalar(const double* kp, const double* ki, const double* kd, double* out, int n, double cte, double diff, bool first, double sum, double dt)
+{
+	for (int l = 0; l < n; l++)
+	{
+		double p_error = kp[l] * cte;
+		double d_error = first ? 0 : kd[l] * diff / dt;
+		double i_error = ki[l] * sum * dt;
+		out[l] = -p_error - i_error - d_error;
+	}
+}
+
+#ifdef PID_BATCH_X86
+
+__attribute__((target("avx2")))
+static void kernel_avx2(const double* kp, const double* ki, const double* kd, double* out, int n, double cte, double diff, bool first, double sum, double dt)
+{
+	const __m256d vcte = _mm256_set1_pd(cte);
+	const __m256d vdiff = _mm256_set1_pd(diff);
+	const __m256d vsum = _mm256_set1_pd(sum);
+	const __m256d vdt = _mm256_set1_pd(dt);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d negzero = _mm256_set1_pd(-0.0);				// -0 - p is exactly -p, also for p == 0
+	for (int l = 0; l < n; l += 4)
+	{
+		__m256d p_error = _mm256_mul_pd(_mm256_load_pd(kp + l), vcte);
+		__m256d d_error = first ? zero : _mm256_div_pd(_mm256_mul_pd(_mm256_load_pd(kd + l), vdiff), vdt);
+		__m256d i_error = _mm256_mul_pd(_mm256_mul_pd(_mm256_load_pd(ki + l), vsum), vdt);
+		__m256d total = _mm256_sub_pd(_mm256_sub_pd(_mm256_sub_pd(negzero, p_error), i_error), d_error);
+		_mm256_store_pd(out + l, total);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512(const double* kp, const double* ki, const double* kd, double* out, int n, double cte, double diff, bool first, double sum, double dt)
+{
+	const __m512d vcte = _mm512_set1_pd(cte);
+	const __m512d vdiff = _mm512_set1_pd(diff);
+	const __m512d vsum = _mm512_set1_pd(sum);
+	const __m512d vdt = _mm512_set1_pd(dt);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d negzero = _mm512_set1_pd(-0.0);
+	for (int l = 0; l < n; l += 8)
+	{
+		__m512d p_error = _mm512_mul_pd(_mm512_load_pd(kp + l), vcte);
+		__m512d d_error = first ? zero : _mm512_div_pd(_mm512_mul_pd(_mm512_load_pd(kd + l), vdiff), vdt);
+		__m512d i_error = _mm512_mul_pd(_mm512_mul_pd(_mm512_load_pd(ki + l), vsum), vdt);
+		__m512d total = _mm512_sub_pd(_mm512_sub_pd(_mm512_sub_pd(negzero, p_error), i_error), d_error);
+		_mm512_store_pd(out + l, total);
+	}
+}
+
+#endif
+
+// Select the best kernel for this CPU, once
+static BatchKernel select_kernel(const char** name)
+{
+#ifdef PID_BATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		*name = "avx512";
+		return kernel_avx512;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "avx2";
+		return kernel_avx2;
+	}
+#endif
+	*name = "scalar";
+	return kernel_scalar;
+}
+
+static const char* kernel_name = nullptr;
+static const BatchKernel kernel = select_kernel(&kernel_name);
+
+const char* PIDBatch::Isa()
+{
+	return kernel_name;
+}
+
+PIDBatch::PIDBatch()
+{
+	kp = ki = kd = out = nullptr;
+	count = padded = 0;
+	sample_cost = PID::CostFunction(COST_CTE);
+	Init(nullptr, nullptr, nullptr, 0);
+}
+
+double* PIDBatch::lane(std::vector<double>& v) const
+{
+	// 8 extra doubles to be able to align the start to 64 bytes
+	v.assign(size_t(padded) + 8, 0.0);
+	uintptr_t addr = reinterpret_cast<uintptr_t>(v.data());
+	return reinterpret_cast<double*>((addr + 63) & ~uintptr_t(63));
+}
+
+void PIDBatch::Init(const double* Kp, const double* Ki, const double* Kd, int n)
+{
+	count = n;
+	padded = (n + 7) & ~7;
+	kp = lane(kp_store);
+	ki = lane(ki_store);
+	kd = lane(kd_store);
+	out = lane(out_store);
+	for (int l = 0; l < n; l++)
+	{
+		kp[l] = Kp[l];
+		ki[l] = Ki[l];
+		kd[l] = Kd[l];
+	}
+	bFirstUpdate = true;
+	cte = diff_cte = prev_cte = sum_cte = 0;
+	dt_proportional = 1;
+	samplenum = 0;
+	total_cte_err = 0;
+	total_cte_len = 0;
+}
+
+void PIDBatch::UpdateError(double _cte, double speed, double angle)
+{
+	if (speed<0.001) speed = 0.001;								// don't divide by zero
+	dt_proportional = 100 / speed;
+
+	cte = _cte;
+	diff_cte = cte - prev_cte;
+	prev_cte = cte;
+	sum_cte += cte;
+
+	total_cte_err += sample_cost(cte, speed, angle);
+	total_cte_len++;
+}
+
+const double* PIDBatch::TotalError()
+{
+	samplenum++;
+	kernel(kp, ki, kd, out, padded, cte, diff_cte, bFirstUpdate, sum_cte, dt_proportional);
+	bFirstUpdate = false;
+	return out;
+}
@@ -0,0 +1,76 @@
+#ifndef PID_BATCH_H
+#define PID_BATCH_H
+#include <vector>
+#include "PID.h"
+
+// PIDBatch class:
+//   Evaluates many (Kp, Ki, Kd) gain sets of the PID controller over the same CTE / speed sequence ( e.g. a recorded trace ) at once.
+//   The gains and the outputs are stored as a structure of arrays, and every sample is applied to all the gain sets with
+//   AVX-512 or AVX2 instructions if the CPU supports them ( with a scalar fallback ).
+//   As the input sequence is the same for all gain sets, the error state ( previous CTE, sum of CTEs ) and the cost value are also the same,
+//   so they are kept only once. The outputs and the cost value are identical to the ones of the scalar PID class with its defaults:
+//   the speed proportional timing without dropped frames ( UpdateError(cte, speed, angle) ), the MEAN objective, every sample scored
+//   and no early stop. The rest of the PID options ( objectives, score window, frames, MEASURED timing ) are not supported.
+//   pid_bench checks the equivalence on its canned frames ( --check ) before it measures the batch against the scalar PID.
+class PIDBatch {
+
+public:
+	PIDBatch();
+
+	/**
+	* Initialize the gain sets
+	* @param Kp, Ki, Kd The coefficients of the gain sets, n of each
+	* @param n The number of gain sets
+	*/
+	void Init(const double* Kp, const double* Ki, const double* Kd, int n);
+
+	/**
+	* Update the error state with the next sample, like PID::UpdateError()
+	* @param cte The current cross track error
+	*/
+	void UpdateError(double cte, double speed, double angle);
+
+	/**
+	* Calculate the output of every gain set, like PID::TotalError()
+	* @output The outputs of the gain sets, valid until the next call
+	*/
+	const double* TotalError();
+
+	// Select the terms of the cost value, like PID::SetCostTerms()
+	void SetCostTerms(unsigned terms) { sample_cost = PID::CostFunction(terms); }
+
+	// The cost value of the samples since Init(), like PID::GetCostValue()
+	double GetCostValue() const { return total_cte_err / total_cte_len; }
+
+	int size() const { return count; }
+
+	// The name of the used instruction set: "avx512", "avx2" or "scalar"
+	static const char* Isa();
+
+	int samplenum;
+
+private:
+	double* lane(std::vector<double>& v) const;
+
+	// the gain sets and the outputs, padded to a multiple of 8 and aligned to 64 bytes
+	std::vector<double> kp_store, ki_store, kd_store, out_store;
+	double* kp;
+	double* ki;
+	double* kd;
+	double* out;
+	int count;
+	int padded;
+
+	// the error state, the same for all gain sets
+	bool bFirstUpdate;
+	double cte;
+	double diff_cte;			// cte - prev_cte, 0 at the first update
+	double prev_cte;
+	double sum_cte;
+	double dt_proportional;
+	double total_cte_err;
+	int total_cte_len;
+	PID::SampleCost sample_cost;
+};
+
+#endif  // PID_BATCH_H
@@ -0,0 +1,17 @@
+#include "pidcore.h"
+
+Controller::Controller(const SessionConfig& config) : session(config)
+{
+}
+
+Controller::Output Controller::control(const Telemetry& t, double elapsed)
+{
+	Output out;
+	logic(session.pid, session.pid_throttle, session.optimal_speed, t.cte, t.speed, t.angle, out.steer_value, out.throttle, 1, elapsed);
+	return out;
+}
+
+size_t Controller::process(const char* data, size_t length)
+{
+	return process_message(data, length, session);
+}
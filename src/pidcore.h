@@ -0,0 +1,57 @@
+#ifndef PIDCORE_H
+#define PIDCORE_H
+#include <stddef.h>
+#include "PID.h"
+#include "session.h"
+#include "telemetry.h"
+
+// pidcore: the controller core of the pid application as a library, without the websocket server ( uWS, ssl, libuv ).
+//   It contains the PID controllers and their trainer ( PID, PIDTRAINER, the optimizers, the checkpoints ), the codec of the
+//   simulator messages ( decode_message(), ReplyWriter ), the control logic ( logic(), Session ), the logger, the latency
+//   histograms and the trace files. The applications of the project ( pid, pid_sim, pid_train, pid_bench ) are all built on it.
+//   An application which has the state of the car in its own process can use the Controller below, without any websocket hop.
+
+// Controller class:
+//   The steering and throttle controllers of one car, with the settings of a SessionConfig, the same way as a connection of the pid
+//   application drives the car. Either the telemetry values are passed directly ( control() ), or the messages of the simulator
+//   protocol ( process() ), which also runs the training of the steering controller in training mode.
+//   It's not thread safe, one Controller must be used by one thread at a time.
+class Controller {
+
+public:
+	explicit Controller(const SessionConfig& config = SessionConfig());
+
+	// The control values of one step
+	struct Output {
+		double steer_value;		// in the [-1,1] interval
+		double throttle;
+	};
+
+	/**
+	* Compute the control values of a telemetry sample. This is the driving mode: the training runs only through process().
+	* @param t The state of the car
+	* @param elapsed The measured time since the previous sample in seconds, only used with Timing::MEASURED ( 0 if it's unknown )
+	* @output The new control values
+	*/
+	Output control(const Telemetry& t, double elapsed = 0);
+
+	/**
+	* Process a message of the simulator, like the pid application does it ( @see process_message() )
+	* @param data, length The message
+	* @output The length of the reply ( @see reply() ), 0 if there is nothing to send back
+	* If the latency is measured ( SessionConfig::measure_latency ), state().latency->sent() must be called after sending the reply.
+	*/
+	size_t process(const char* data, size_t length);
+
+	// The reply of the last process() call, it's valid until the next call
+	const char* reply() const { return session.reply.data(); }
+
+	// The state of the controllers and the trainer
+	Session& state() { return session; }
+	const Session& state() const { return session; }
+
+private:
+	Session session;
+};
+
+#endif  // PIDCORE_H
@@ -0,0 +1,164 @@
+#include <string.h>
+#include <algorithm>
+#include "pipeline.h"
+#include "latency.h"
+#include "logger.h"
+
+#if defined(__linux__)
+	#include <pthread.h>
+#elif defined(_WIN32)
+	#include <windows.h>
+#endif
+
+ControlPipeline::ControlPipeline(Executor _execute, std::function<void()> _wake, int cpu, bool _coalesce)
+	: execute(std::move(_execute)), wake(std::move(_wake)), coalesce(_coalesce), wake_pending(false), sleeping(false), stopping(false)
+{
+	if (coalesce)
+	{
+		batch.reserve(RING_SIZE);
+	}
+	worker = std::thread(&ControlPipeline::run, this);
+	if (cpu >= 0)
+	{
+		bool pinned = false;
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pinned = pthread_setaffinity_np(worker.native_handle(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+		pinned = SetThreadAffinityMask(worker.native_handle(), DWORD_PTR(1) << cpu) != 0;
+#endif
+		if (!pinned)
+		{
+			LOG(LogChannel::CONSOLE, LogLevel::ERROR, "Failed to pin the control thread to CPU {}", cpu);
+		}
+	}
+}
+
+ControlPipeline::~ControlPipeline()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_one();
+	worker.join();
+}
+
+bool ControlPipeline::submit(const PipelineCommand& cmd)
+{
+	if (!commands.push(cmd))
+		return false;
+	// the push must be visible before sleeping is checked, the control thread does the same in the opposite order ( @see run() )
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		wakeup.notify_one();
+	}
+	return true;
+}
+
+void ControlPipeline::post(const PipelineReply& r)
+{
+	// the network thread drains the replies, so a full ring only has to wait for it
+	while (!replies.push(r))
+	{
+		wake();
+		std::this_thread::yield();
+	}
+	if (!wake_pending.exchange(true, std::memory_order_seq_cst))
+	{
+		wake();
+	}
+}
+
+void ControlPipeline::reply(uint64_t conn, const char* data, size_t length)
+{
+	PipelineReply r;
+	r.kind = PipelineReply::SEND;
+	r.conn = conn;
+	r.length = std::min(length, sizeof(r.data));
+	memcpy(r.data, data, r.length);
+	post(r);
+}
+
+void ControlPipeline::close(uint64_t conn)
+{
+	PipelineReply r;
+	r.kind = PipelineReply::CLOSE;
+	r.conn = conn;
+	r.length = 0;
+	post(r);
+}
+
+void ControlPipeline::run_coalesced(const PipelineCommand& first)
+{
+	batch.clear();
+	batch.push_back(first);
+	PipelineCommand cmd;
+	while (batch.size() < RING_SIZE && commands.pop(cmd))
+		batch.push_back(cmd);
+
+	// from the last to the first, so the latest message of a connection is found first ( there are only a few connections )
+	latest.clear();
+	for (size_t i = batch.size(); i-- > 0; )
+	{
+		PipelineCommand& c = batch[i];
+		// only the telemetry is coalesced, the other events are executed, and they don't supersede a telemetry
+		if (c.kind != PipelineCommand::MESSAGE || c.message != MessageKind::TELEMETRY)
+			continue;
+		bool superseded = false;
+		for (PipelineCommand* l : latest)
+		{
+			if (l->conn == c.conn)
+			{
+				l->frames += c.frames;
+				superseded = true;
+				break;
+			}
+		}
+		if (superseded)
+			c.frames = 0;
+		else
+			latest.push_back(&c);
+	}
+	for (PipelineCommand& c : batch)
+	{
+		if (c.kind != PipelineCommand::MESSAGE || c.frames > 0)
+			execute(c);
+	}
+}
+
+void ControlPipeline::run()
+{
+	PipelineCommand cmd;
+	uint64_t idle_since = monotonic_ns();
+	for (;;)
+	{
+		if (commands.pop(cmd))
+		{
+			if (coalesce)
+				run_coalesced(cmd);
+			else
+				execute(cmd);
+			idle_since = monotonic_ns();
+			continue;
+		}
+		if (stopping.load(std::memory_order_relaxed))
+			return;
+		if (monotonic_ns() - idle_since < SPIN_NS)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		wakeup.wait(lock, [this] { return stopping.load(std::memory_order_relaxed) || !commands.empty(); });
+		sleeping.store(false, std::memory_order_relaxed);
+		idle_since = monotonic_ns();
+	}
+}
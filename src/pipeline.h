@@ -0,0 +1,118 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "spsc_ring.h"
+#include "telemetry.h"
+
+class Session;
+
+// A request of the network thread to the control thread
+struct PipelineCommand {
+	enum Kind {
+		OPEN,					// a new connection with its session, the control thread owns the session from now on
+		MESSAGE,				// a decoded message of a connection
+		CLOSE,					// the connection was closed, its session must be deleted
+		TICK,					// the watchdog timer of the event loop
+	} kind;
+	uint64_t conn;				// the id of the connection
+	Session* session;
+	MessageKind message;
+	Telemetry telemetry;		// the decoded values of a TELEMETRY message
+	uint64_t received;			// the time of receiving the message, monotonic_ns()
+	int frames;					// the number of the telemetry messages it replaces, including itself ( more than 1 if it superseded others )
+};
+
+// An action of the control thread, executed by the network thread
+struct PipelineReply {
+	enum Kind {
+		SEND,					// send the data to the connection
+		CLOSE,					// close the connection
+	} kind;
+	uint64_t conn;
+	size_t length;
+	char data[256];				// a copy of the reply, the ReplyWriter of the session is reused by the next message
+};
+
+// ControlPipeline class:
+//   Runs the control computations ( the PID controllers, the trainer ) of an event loop on a separate thread, so a slow write
+//   or a long training step does not delay the next socket read, and the I/O does not disturb the timing of the control.
+//   The network thread decodes the messages and submits them through a lock-free SPSC ring. The control thread executes them,
+//   and posts the replies back through another ring, calling the wake function, which must wake up the event loop
+//   ( e.g. uv_async_send() ) to drain() the replies on the network thread.
+//   The control thread spins for a short time after every command, then it sleeps until the next one is submitted.
+//   In coalescing mode the control thread takes all the waiting commands at once, and only executes the latest TELEMETRY message of
+//   every connection, the superseded ones are dropped, and their number is added to the frames of the latest one ( the other
+//   messages are all executed ). So if the control
+//   thread falls behind, it answers the newest state instead of working through a backlog of old ones.
+class ControlPipeline {
+
+public:
+	static const size_t RING_SIZE = 1024;
+
+	typedef std::function<void(const PipelineCommand&)> Executor;
+
+	/**
+	* Start the control thread
+	* @param _execute Executes the commands on the control thread
+	* @param _wake Wakes up the event loop of the network thread, it's called from the control thread
+	* @param cpu Pin the control thread to this CPU core ( -1 = don't pin )
+	* @param _coalesce Drop the superseded messages of the connections
+	*/
+	ControlPipeline(Executor _execute, std::function<void()> _wake, int cpu = -1, bool _coalesce = false);
+
+	// Stop the control thread, after the already submitted commands are executed
+	~ControlPipeline();
+
+	// Network thread: pass a command to the control thread. Returns false if the ring is full.
+	bool submit(const PipelineCommand& cmd);
+
+	// Network thread: execute the replies of the control thread
+	template <typename F>
+	void drain(F execute_reply) {
+		// cleared first, so a reply posted during the draining wakes up the event loop again
+		wake_pending.store(false, std::memory_order_seq_cst);
+		PipelineReply r;
+		while (replies.pop(r))
+			execute_reply(r);
+	}
+
+	// Control thread: send a reply to a connection, and close a connection
+	void reply(uint64_t conn, const char* data, size_t length);
+	void close(uint64_t conn);
+
+private:
+	ControlPipeline(const ControlPipeline&) = delete;
+	ControlPipeline& operator=(const ControlPipeline&) = delete;
+
+	void post(const PipelineReply& r);
+	void run();
+	// execute the waiting commands, with only the latest message of every connection
+	void run_coalesced(const PipelineCommand& first);
+
+	// the time of spinning for the next command, before the control thread goes to sleep
+	static const uint64_t SPIN_NS = 50000;
+
+	SpscRing<PipelineCommand, RING_SIZE> commands;
+	SpscRing<PipelineReply, RING_SIZE> replies;
+	Executor execute;
+	std::function<void()> wake;
+	bool coalesce;
+	std::vector<PipelineCommand> batch;	// the waiting commands in coalescing mode
+	std::vector<PipelineCommand*> latest;	// the latest message of every connection in the batch
+	std::atomic<bool> wake_pending;		// the event loop was woken up, and it hasn't drained the replies yet
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::atomic<bool> sleeping;			// the control thread is waiting ( or about to wait ) on wakeup
+	std::atomic<bool> stopping;
+	std::thread worker;
+};
+
+#endif  // PIPELINE_H
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include "session.h"
+#include "logger.h"
+
+using std::min;
+using std::max;
+
+SessionConfig::SessionConfig()
+{
+	params[0] = 0.164142;
+	params[1] = 4.4004e-06;
+	params[2] = 9.23562;
+	// 10% of the coefficients, if the deltas are not given
+	deltas[0] = params[0] * 0.1;
+	deltas[1] = params[1] * 0.1;
+	deltas[2] = params[2] * 0.1;
+	training = false;
+	optimizer = OptimizerKind::TWIDDLE;
+	cost_terms = COST_CTE;
+	timing = Timing::SPEED;
+	train_samplenum = 4500;
+	optimal_speed = 30;
+	measure_latency = false;
+	trace_capacity = 1 << 20;
+}
+
+bool parse_early_stop_option(const char* arg, EarlyStopConfig& early_stop)
+{
+	if (strncmp(arg, "--stop-cte=", 11) == 0)
+		early_stop.max_cte = atof(arg + 11);
+	else if (strcmp(arg, "--stop-cost") == 0)
+		early_stop.cost_limit = true;
+	else if (strncmp(arg, "--stop-speed=", 13) == 0)
+		early_stop.min_speed = atof(arg + 13);
+	else if (strncmp(arg, "--stop-warmup=", 14) == 0)
+		early_stop.warmup = atoi(arg + 14);
+	else
+		return false;
+	return true;
+}
+
+bool parse_score_window_option(const char* arg, ScoreWindow& window)
+{
+	if (strncmp(arg, "--score-skip=", 13) == 0)
+		window.begin = atoi(arg + 13);
+	else if (strncmp(arg, "--score-last=", 13) == 0)
+		window.begin = -atoi(arg + 13);
+	else if (strncmp(arg, "--score-range=", 14) == 0)
+	{
+		char* end;
+		window.begin = int(strtol(arg + 14, &end, 10));
+		if (*end != ':')
+			return false;
+		window.end = int(strtol(end + 1, &end, 10));
+		if (*end != '\0')
+			return false;
+	}
+	else
+		return false;
+	return true;
+}
+
+Session::Session(const SessionConfig& config)
+{
+	optimal_speed = config.optimal_speed;
+	last_message = run_start = 0;
+	dropped_frames = 0;
+	prev_received = 0;
+	if (config.measure_latency)
+	{
+		latency.reset(new LatencyStats());
+	}
+	if (!config.trace_prefix.empty())
+	{
+		// the sessions are numbered in the order of their creation, in the whole process
+		static std::atomic<int> session_counter(0);
+		std::string path = config.trace_prefix + "." + std::to_string(session_counter++) + ".trace";
+		trace.reset(new TraceWriter());
+		if (!trace->open(path.c_str(), config.trace_capacity))
+		{
+			LOG(LogChannel::CONSOLE, LogLevel::ERROR, "Failed to create the trace file");
+			trace.reset();
+		}
+	}
+	pid.SetCostTerms(config.cost_terms);
+	pid.SetObjective(config.objective);
+	pid.SetScoreWindow(config.score_window);
+	pid.SetTiming(config.timing);
+	pid_throttle.SetTiming(config.timing);
+	if (config.training)
+	{
+		// the trainer initializes the pid with the first parameters of the optimizer
+		trainer.reset(new PIDTRAINER(&pid, config.train_samplenum, make_optimizer(config.optimizer, config.params, config.deltas)));
+		trainer->set_early_stop(config.early_stop);
+		if (!config.checkpoint.empty())
+		{
+			trainer->set_checkpoint(config.checkpoint.c_str());
+		}
+	}
+	else
+	{
+		pid.Init(config.params[0], config.params[1], config.params[2]);
+	}
+	pid_throttle.Init(999999, 0, 0);
+	select_handlers();
+}
+
+void Session::select_handlers()
+{
+	handler = select_message_handler(*this);
+	decoded_handler = select_decoded_handler(*this);
+}
+
+Session::~Session()
+{
+	if (dropped_frames)
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "{} superseded telemetry messages were dropped", dropped_frames);
+	}
+	if (latency && latency->histogram(LatencyStage::TOTAL).count())
+	{
+		latency->dump();
+	}
+}
+
+void Session::adopt_trainer(std::unique_ptr<PIDTRAINER> previous)
+{
+	trainer = std::move(previous);
+	trainer->attach(&pid);
+	pid_throttle.Init(999999, 0, 0);
+	run_start = 0;
+	select_handlers();
+}
+
+std::unique_ptr<PIDTRAINER> Session::release_trainer()
+{
+	if (trainer && pid.samplenum > 0)
+	{
+		trainer->abort_run();
+	}
+	std::unique_ptr<PIDTRAINER> released = std::move(trainer);
+	select_handlers();
+	return released;
+}
+
+void logic(PID& pid, PID& pid_throttle, double optimal_speed, double cte, double speed, double angle, double& steer_value, double& throttle, int frames, double elapsed)
+{
+	pid.UpdateError(cte, speed, angle, frames, elapsed);
+	steer_value = pid.TotalError();
+	steer_value = min(steer_value, 1.0);
+	steer_value = max(steer_value, -1.0);
+	pid_throttle.UpdateError(speed - optimal_speed, speed, angle, frames, elapsed);
+	throttle = pid_throttle.TotalError();
+	throttle = min(throttle, 1.0);
+	throttle = max(throttle, 0.0);
+}
+
+// End the current run of the trainer: evaluate it, initialize the pid for the next one, and restart the simulator with a reset message
+// ( seq is the "seq" field of the telemetry the reset answers )
+static size_t finish_run(Session& session, double seq)
+{
+	session.trainer->ready();
+	session.pid.samplenum = 0;
+	session.run_start = monotonic_ns();
+	session.prev_received = 0;				// the time of the restart is not a time step
+	return session.reply.reset(seq);
+}
+
+// The message handlers of the sessions, compiled for every mode: with or without the trainer, and with or without the
+// instrumentation ( latency measurement, trace ). The production driving ( no training, no instrumentation ) has none of their checks.
+
+// The processing of a decoded "42" message, shared by both handlers
+template <bool TRAINING, bool INSTRUMENTED>
+static inline size_t handle_decoded(MessageKind kind, const Telemetry& t, uint64_t received, int frames, Session& session)
+{
+	PID& pid = session.pid;
+	ReplyWriter& reply = session.reply;
+	LatencyStats* latency = INSTRUMENTED ? session.latency.get() : nullptr;
+	TraceWriter* trace = INSTRUMENTED ? session.trace.get() : nullptr;
+	size_t msglen = 0;
+
+	if (TRAINING)
+	{
+		uint64_t now = monotonic_ns();
+		session.last_message = now;
+		if (session.run_start == 0)
+		{
+			session.run_start = now;
+		}
+		if (pid.samplenum == session.trainer->target_samplenum)
+		{
+			return finish_run(session, kind == MessageKind::TELEMETRY ? t.seq : 0);
+		}
+	}
+
+	switch (kind) {
+	case MessageKind::TELEMETRY: {
+		double cte = t.cte;
+		double speed = t.speed;
+		double angle = t.angle;
+		double steer_value, throttle;
+
+		if (frames > 1)
+		{
+			session.dropped_frames += frames - 1;
+		}
+		// the time step since the previous telemetry, if the receive times are taken
+		double elapsed = 0;
+		if (received && session.prev_received)
+		{
+			elapsed = double(received - session.prev_received) * 1e-9;
+		}
+		session.prev_received = received;
+		logic(pid, session.pid_throttle, session.optimal_speed, cte, speed, angle, steer_value, throttle, frames, elapsed);
+		if (latency)
+			latency->stage(LatencyStage::LOGIC);
+
+		msglen = reply.steer(steer_value, throttle, t.seq);
+		if (latency)
+			latency->stage(LatencyStage::ENCODE);
+
+		if (trace)
+		{
+			TraceRecord rec = { received, cte, speed, angle, steer_value, throttle, pid.GetPError(), pid.GetIError(), pid.GetDError() };
+			trace->append(rec);
+		}
+
+		if (TRAINING && pid.GetStopReason() != StopReason::NONE)
+		{
+			// a hopeless run: it's scored now, and the simulator is restarted instead of steering
+			msglen = finish_run(session, t.seq);
+		}
+
+		LOG(LogChannel::CONSOLE, LogLevel::DEBUG, "CTE: {} Steering Value: {}", cte, steer_value);
+		LOG(LogChannel::CONSOLE, LogLevel::DEBUG, "42[\"steer\",{\"steering_angle\":{},\"throttle\":{}}]", steer_value, throttle);
+		break;
+	}  // end "telemetry" case
+	case MessageKind::MANUAL:
+		// Manual driving
+		msglen = reply.manual();
+		break;
+	default:
+		break;
+	}
+	return msglen;
+}
+
+// The handler of the received messages
+template <bool TRAINING, bool INSTRUMENTED>
+static size_t handle_message(const char* data, size_t length, Session& session)
+{
+	LatencyStats* latency = INSTRUMENTED ? session.latency.get() : nullptr;
+	uint64_t received = ((INSTRUMENTED && session.trace) || session.pid.GetTiming() == Timing::MEASURED) ? monotonic_ns() : 0;
+	if (latency)
+	{
+		latency->dump_if_requested();
+		latency->start();
+	}
+	if (length && length > 2 && data[0] == '4' && data[1] == '2') {
+		Telemetry t;
+		MessageKind kind = decode_message(data, length, t);
+		if (latency)
+			latency->stage(LatencyStage::PARSE);
+		return handle_decoded<TRAINING, INSTRUMENTED>(kind, t, received, 1, session);
+	}  // end websocket message if
+	return 0;
+}
+
+// The handler of the messages decoded earlier: by the network thread in pipelined mode, or into the mailbox in coalescing mode
+template <bool TRAINING, bool INSTRUMENTED>
+static size_t handle_deferred(MessageKind kind, const Telemetry& t, uint64_t received, int frames, Session& session)
+{
+	LatencyStats* latency = INSTRUMENTED ? session.latency.get() : nullptr;
+	if (latency)
+	{
+		latency->dump_if_requested();
+		latency->start(received);
+		latency->stage(LatencyStage::PARSE);
+	}
+	// only the "42" messages are passed on
+	return handle_decoded<TRAINING, INSTRUMENTED>(kind, t, received, frames, session);
+}
+
+bool post_message(const char* data, size_t length, Session& session)
+{
+	if (length <= 2 || data[0] != '4' || data[1] != '2')
+		return false;
+	Mailbox& mailbox = session.mailbox;
+	Telemetry t;
+	MessageKind kind = decode_message(data, length, t);
+	if (kind == MessageKind::TELEMETRY)
+	{
+		mailbox.frames++;
+	}
+	else if (mailbox.pending && mailbox.kind == MessageKind::TELEMETRY)
+	{
+		// the other events don't supersede a telemetry, it must be answered
+		return false;
+	}
+	mailbox.kind = kind;
+	mailbox.t = t;
+	mailbox.received = monotonic_ns();
+	if (mailbox.pending)
+		return false;
+	mailbox.pending = true;
+	return true;
+}
+
+size_t process_mailbox(Session& session)
+{
+	Mailbox& mailbox = session.mailbox;
+	if (!mailbox.pending)
+		return 0;
+	int frames = mailbox.frames;
+	mailbox.pending = false;
+	mailbox.frames = 0;
+	return process_decoded(mailbox.kind, mailbox.t, mailbox.received, frames, session);
+}
+
+MessageHandler select_message_handler(const Session& session)
+{
+	bool instrumented = session.latency || session.trace;
+	if (session.trainer)
+		return instrumented ? &handle_message<true, true> : &handle_message<true, false>;
+	return instrumented ? &handle_message<false, true> : &handle_message<false, false>;
+}
+
+DecodedHandler select_decoded_handler(const Session& session)
+{
+	bool instrumented = session.latency || session.trace;
+	if (session.trainer)
+		return instrumented ? &handle_deferred<true, true> : &handle_deferred<true, false>;
+	return instrumented ? &handle_deferred<false, true> : &handle_deferred<false, false>;
+}
+
+WatchdogAction watchdog_check(Session& session, const WatchdogConfig& config, uint64_t now)
+{
+	// nothing to wait for before the first message
+	if (!session.trainer || session.last_message == 0)
+		return WatchdogAction::NONE;
+
+	if (config.stall_timeout > 0 && double(now - session.last_message) > config.stall_timeout * 1e9)
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "No message from the simulator for {} s, it is hung", double(now - session.last_message) / 1e9);
+		if (session.pid.samplenum > 0)
+		{
+			session.trainer->abort_run();
+		}
+		session.last_message = session.run_start = 0;
+		session.prev_received = 0;
+		return WatchdogAction::DISCONNECT;
+	}
+	if (config.run_timeout > 0 && double(now - session.run_start) > config.run_timeout * 1e9)
+	{
+		LOG(LogChannel::CONSOLE, LogLevel::ERROR, "The simulation run did not finish in {} s, it is restarted", config.run_timeout);
+		session.trainer->abort_run();
+		session.pid_throttle.Init(999999, 0, 0);
+		session.run_start = now;
+		session.prev_received = 0;			// the time of the restart is not a time step, like in finish_run()
+		return WatchdogAction::RETRY_RUN;
+	}
+	return WatchdogAction::NONE;
+}
@@ -0,0 +1,192 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include "PID.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "trace.h"
+
+// The settings of the controllers. It is parsed once at startup, and every new session is created with it.
+struct SessionConfig {
+	double params[3];			// the P, I, D coefficients of the steering controller
+	double deltas[3];			// the initial step sizes of the optimizer ( training only )
+	bool training;				// train the steering controller with a PIDTRAINER
+	OptimizerKind optimizer;	// the optimization algorithm of the PIDTRAINER
+	std::string checkpoint;		// if not empty, the PIDTRAINER resumes from this checkpoint file, and saves into it after every run
+	EarlyStopConfig early_stop;	// the rules to end the hopeless runs of the training early
+	unsigned cost_terms;		// the CostTerms of the cost value of the steering controller ( training only )
+	Objective objective;		// the statistic of the sample costs used as the cost value of a run ( training only )
+	ScoreWindow score_window;	// the scored samples of a run ( training only )
+	Timing timing;				// the time step of the I and D terms of the controllers
+	int train_samplenum;		// the length of one simulation run in training mode
+	double optimal_speed;		// the target speed of the throttle controller
+	bool measure_latency;		// collect the latency histograms of the message processing stages
+	std::string trace_prefix;	// if not empty, every session records its control steps into a <trace_prefix>.<n>.trace file
+	uint64_t trace_capacity;	// the maximum number of records in a trace file
+
+	// the previously fine-tuned, best PID coefficients, without training
+	SessionConfig();
+};
+
+// The settings of the watchdog of the training sessions. In training mode the PIDTRAINER waits for the end of the current run,
+// so if the simulator stops sending telemetry ( it hangs ), the training would wait forever.
+struct WatchdogConfig {
+	double stall_timeout = 0;		// seconds without any message, after which the simulator is considered hung ( 0 = off )
+	double run_timeout = 0;			// the maximum length of a simulation run in seconds, a longer run is restarted ( 0 = off )
+	std::string restart_command;	// a shell command to restart the simulator, executed when it's hung
+};
+
+// What the server must do with a session after the watchdog check
+enum class WatchdogAction {
+	NONE,
+	RETRY_RUN,						// the run was too long, it was discarded: send a reset message to restart it
+	DISCONNECT,						// the simulator is hung, the run was discarded: close the connection ( and restart the simulator )
+};
+
+/**
+* Parse an early stop option of the command line, shared by the applications which can train
+*   --stop-cte=<m>		Stop a run if |cte| is above this
+*   --stop-cost			Stop a run if its cost can't be better than the best one anymore
+*   --stop-speed=<mph>	Stop a run if the speed is below this, after the warm-up
+*   --stop-warmup=<n>	The number of samples at the start of a run without the speed rule ( 200 by default )
+* @param arg The command line argument
+* @param early_stop The rules, updated by the option
+* @output false if arg is not an early stop option
+*/
+bool parse_early_stop_option(const char* arg, EarlyStopConfig& early_stop);
+
+/**
+* Parse a scoring window option of the training
+*   --score-skip=<n>		Don't score the first n samples of a run ( the warm-up )
+*   --score-last=<n>		Score only the last n samples of a run
+*   --score-range=<a:b>	Score only the samples from a to b ( a segment of the track )
+* @param arg The command line argument
+* @param window The scoring window, updated by the option
+* @output false if arg is not a valid scoring window option
+*/
+bool parse_score_window_option(const char* arg, ScoreWindow& window);
+
+class Session;
+
+// The function which processes the incoming messages of a session, @see process_message()
+typedef size_t (*MessageHandler)(const char* data, size_t length, Session& session);
+
+// The function which processes the already decoded messages of a session, @see process_decoded()
+typedef size_t (*DecodedHandler)(MessageKind kind, const Telemetry& t, uint64_t received, int frames, Session& session);
+
+// The latest received message of a session in coalescing mode, which is not processed yet ( @see post_message() )
+struct Mailbox {
+	bool pending = false;
+	MessageKind kind = MessageKind::NONE;
+	Telemetry t;
+	uint64_t received = 0;		// monotonic_ns() of receiving the message
+	int frames = 0;				// the number of the telemetry messages received since the last processed one, including this one
+};
+
+// Session class:
+//   The whole state of the controller for one simulator connection: the steering and throttle PID controllers,
+//   the optional PIDTRAINER, and the buffer of the reply messages.
+//   It's allocated when a simulator connects and stored in the user data of its websocket, so the sessions of concurrent
+//   simulators are completely independent from each other.
+class Session {
+
+public:
+	explicit Session(const SessionConfig& config);
+	~Session();
+
+	PID pid;						// steering controller
+	PID pid_throttle;				// throttle controller
+	std::unique_ptr<PIDTRAINER> trainer;	// only used in training mode
+	double optimal_speed;
+	ReplyWriter reply;
+	std::unique_ptr<LatencyStats> latency;	// only if measure_latency was set, dumped when the session ends
+	std::unique_ptr<TraceWriter> trace;		// only if trace_prefix was set
+
+	// the message handlers of the mode of the session ( training, instrumented ), selected when the session is set up
+	MessageHandler handler;
+	DecodedHandler decoded_handler;
+
+	// the time of the last message and the start of the current run, in training mode ( monotonic_ns(), 0 before the first message )
+	uint64_t last_message;
+	uint64_t run_start;
+
+	// the receive time of the previous telemetry, for the measured timing of the controllers ( 0 if there is none )
+	uint64_t prev_received;
+
+	// coalescing mode: the latest message, and the number of the superseded ones which were dropped
+	Mailbox mailbox;
+	uint64_t dropped_frames;
+
+	/**
+	* Take over the training of a previous session, instead of the own trainer. The current run of the trainer is repeated from the start.
+	* @param previous The trainer of the previous session ( @see release_trainer() )
+	*/
+	void adopt_trainer(std::unique_ptr<PIDTRAINER> previous);
+
+	// Take the trainer out of the session before it's deleted, to continue the training in a next session. The unfinished run is discarded.
+	std::unique_ptr<PIDTRAINER> release_trainer();
+
+private:
+	void select_handlers();
+
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
+};
+
+// the logic which uses the 2 PID controllers to control the new steer_value and throttle
+// frames is the number of the simulator frames since the previous call ( more than 1 if frames were dropped ),
+// elapsed is the measured time since the previous call in seconds ( 0 if it's unknown, @see PID::UpdateError() )
+void logic(PID& pid, PID& pid_throttle, double optimal_speed, double cte, double speed, double angle, double& steer_value, double& throttle, int frames = 1, double elapsed = 0);
+
+// Select the message handlers for the mode of a session. The handlers of the modes are compiled separately, so the mode is not checked per message.
+MessageHandler select_message_handler(const Session& session);
+DecodedHandler select_decoded_handler(const Session& session);
+
+// process an incoming websocket message
+// It contains the logic which restarts the simulation when a run is finished.
+// The reply is formatted into the ReplyWriter of the session, and its length is returned. (0 if there is nothing to send back)
+// If the latency is measured, the caller must call session.latency->sent() after sending a reply.
+inline size_t process_message(const char* data, size_t length, Session& session)
+{
+	return session.handler(data, length, session);
+}
+
+/**
+* Process a message which was already decoded by another thread ( @see ControlPipeline ), the same way as process_message()
+* @param kind, t The result of decode_message()
+* @param received The time when the message was received, monotonic_ns()
+* @param frames The number of the received messages it replaces, including itself ( the others were dropped, @see Mailbox )
+* @param session The session of the connection
+* @output The length of the reply in session.reply ( 0 if there is nothing to send back )
+* If the latency is measured, the caller must call session.latency->sent() after passing on the reply.
+*/
+inline size_t process_decoded(MessageKind kind, const Telemetry& t, uint64_t received, int frames, Session& session)
+{
+	return session.decoded_handler(kind, t, received, frames, session);
+}
+
+/**
+* Coalescing mode: decode a received message into the mailbox of the session. If the previous message is still there, it's
+* superseded ( latest wins ), so under overload only the newest state of the car is answered, instead of a growing backlog.
+* Only the telemetry messages are counted in the frames of the mailbox, and the other events don't supersede a telemetry.
+* @param data, length The received message
+* @param session The session of the connection
+* @output true if the mailbox was empty, then the caller must schedule the session for process_mailbox()
+*/
+bool post_message(const char* data, size_t length, Session& session);
+
+// Coalescing mode: process the message in the mailbox, like process_message(). Returns the length of the reply ( 0 if there is nothing to send back ).
+size_t process_mailbox(Session& session);
+
+/**
+* Check whether the simulator of a training session is hung, or its current run takes too long. In both cases the run is discarded.
+* @param session The session to check, only the training sessions are checked
+* @param config The timeouts
+* @param now The current time, monotonic_ns()
+* @output The action to be executed by the server
+*/
+WatchdogAction watchdog_check(Session& session, const WatchdogConfig& config, uint64_t now);
+
+#endif  // SESSION_H
@@ -0,0 +1,168 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#ifndef UWS_VCPKG
+	// The websocket client is only available in the Udacity version of the uwebsockets library
+	#include <uWS/uWS.h>
+#endif
+
+#include "simulator.h"
+#include "session.h"
+#include "logger.h"
+
+// pid_sim: the headless simulator stand-in.
+//   pid_sim [--steps=N] [--offset=M] [--speed=S]	Drive the car in-process with the controllers of the pid application ( logic() ) for N steps.
+//   pid_sim --connect=ws://127.0.0.1:4567 [--steps=N]	Connect to a running pid application as the Unity simulator would, and drive the
+//													car with its replies. It exits after N steps. ( 0 = run forever )
+
+// The statistics of the driving, printed at the end
+struct DriveStats {
+	long steps = 0;
+	double sum_cte2 = 0;
+	double max_cte = 0;
+	double sum_speed = 0;
+	int resets = 0;
+
+	void add(const Telemetry& t) {
+		steps++;
+		sum_cte2 += t.cte * t.cte;
+		max_cte = std::max(max_cte, fabs(t.cte));
+		sum_speed += t.speed;
+	}
+
+	void print(const VehicleSim& sim) const {
+		if (steps == 0)
+			return;
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Steps: {} Resets: {} Mean CTE^2: {} Max |CTE|: {} Avg speed: {} mph Off track: {}",
+			steps, resets, sum_cte2 / steps, max_cte, sum_speed / steps, int(sim.off_track()));
+	}
+};
+
+static int run_in_process(VehicleSim& sim, const SessionConfig& config, long steps)
+{
+	Session session(config);
+	DriveStats stats;
+	for (long i = 0; i < steps; i++)
+	{
+		Telemetry t = sim.telemetry();
+		double steer_value, throttle;
+		logic(session.pid, session.pid_throttle, session.optimal_speed, t.cte, t.speed, t.angle, steer_value, throttle, 1, sim.step_time());
+		stats.add(t);
+		sim.step(steer_value, throttle);
+	}
+	stats.print(sim);
+	return 0;
+}
+
+#ifndef UWS_VCPKG
+
+static int run_client(VehicleSim& sim, const char* uri, long steps, double offset)
+{
+	uWS::Hub h;
+	ReplyWriter writer;
+	DriveStats stats;
+
+	auto send_telemetry = [&sim, &writer, &stats](uWS::WebSocket<uWS::CLIENT> ws) {
+		Telemetry t = sim.telemetry();
+		stats.add(t);
+		size_t len = writer.telemetry(t);
+		ws.send(writer.data(), len, uWS::OpCode::TEXT);
+	};
+
+	h.onConnection([&sim, offset, send_telemetry](uWS::WebSocket<uWS::CLIENT> ws, uWS::HttpRequest req) {
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Connected!!!");
+		sim.reset(offset);
+		send_telemetry(ws);
+	});
+
+	h.onMessage([&sim, &stats, steps, offset, send_telemetry](uWS::WebSocket<uWS::CLIENT> ws, char *data, size_t length, uWS::OpCode opCode) {
+		double steer_value, throttle;
+		switch (decode_reply(data, length, steer_value, throttle)) {
+		case MessageKind::STEER:
+			sim.step(steer_value, throttle);
+			break;
+		case MessageKind::RESET:
+			stats.resets++;
+			sim.reset(offset);
+			break;
+		case MessageKind::MANUAL:
+			break;
+		default:
+			return;
+		}
+		if (steps && stats.steps >= steps)
+		{
+			ws.close();
+			return;
+		}
+		send_telemetry(ws);
+	});
+
+	h.onDisconnection([&h, &sim, &stats](uWS::WebSocket<uWS::CLIENT> ws, int code, char *message, size_t length) {
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Disconnected");
+		stats.print(sim);
+		h.getDefaultGroup<uWS::CLIENT>().close();
+		h.getDefaultGroup<uWS::SERVER>().close();
+	});
+
+	h.onError([](void* user) {
+		std::cerr << "Failed to connect" << std::endl;
+		exit(-1);
+	});
+
+	h.connect(uri, nullptr);
+	h.run();
+	return 0;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	long steps = 4500;
+	double offset = 0;
+	const char* uri = nullptr;
+	SessionConfig config;
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (strncmp(arg, "--steps=", 8) == 0)
+			steps = atol(arg + 8);
+		else if (strncmp(arg, "--offset=", 9) == 0)
+			offset = atof(arg + 9);
+		else if (strncmp(arg, "--speed=", 8) == 0)
+			config.optimal_speed = atof(arg + 8);
+		else if (strncmp(arg, "--connect=", 10) == 0)
+			uri = arg + 10;
+		else
+		{
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return -1;
+		}
+	}
+
+	Track track = Track::default_track();
+	VehicleSim sim(track);
+	sim.reset(offset);
+
+	int ret;
+	if (uri)
+	{
+#ifndef UWS_VCPKG
+		ret = run_client(sim, uri, steps, offset);
+#else
+		std::cerr << "The websocket client is not supported with this uwebsockets library" << std::endl;
+		ret = -1;
+#endif
+	}
+	else
+	{
+		ret = run_in_process(sim, config, steps);
+	}
+	Logger::instance().flush();
+	return ret;
+}
@@ -0,0 +1,148 @@
+#include <math.h>
+#include "simulator.h"
+
+static const double MPH_PER_MS = 2.2369362920544;		// 1 m/s in mph
+
+const double Track::step = 1.0;
+
+Track::Track(const std::vector<TrackPiece>& pieces, double _half_width)
+{
+	half_width = _half_width;
+	double x = 0, y = 0, heading = 0;
+	for (const TrackPiece& piece : pieces)
+	{
+		// the points are ~step meters apart, the piece is divided evenly
+		int n = int(piece.length / step + 0.5);
+		double ds = piece.length / n;
+		for (int i = 0; i < n; i++)
+		{
+			xs.push_back(x);
+			ys.push_back(y);
+			headings.push_back(heading);
+			// exact arc ( or line ) step, so the track closes if the pieces do
+			double dh = piece.curvature * ds;
+			if (dh == 0)
+			{
+				x += ds * cos(heading);
+				y += ds * sin(heading);
+			}
+			else
+			{
+				x += (sin(heading + dh) - sin(heading)) / piece.curvature;
+				y -= (cos(heading + dh) - cos(heading)) / piece.curvature;
+			}
+			heading += dh;
+		}
+	}
+}
+
+Track Track::default_track()
+{
+	const double pi = M_PI;
+	const double bend = 30.0 / 180.0 * pi * 60.0;		// 30 degrees on a 60m radius
+	std::vector<TrackPiece> straight = {
+		{ 100, 0 },
+		{ bend, 1 / 60.0 }, { bend, -1 / 60.0 },
+		{ 50, 0 },
+		{ bend, -1 / 60.0 }, { bend, 1 / 60.0 },
+		{ 100, 0 },
+	};
+	std::vector<TrackPiece> pieces;
+	for (int side = 0; side < 2; side++)
+	{
+		pieces.insert(pieces.end(), straight.begin(), straight.end());
+		pieces.push_back({ pi * 100, 1 / 100.0 });			// 180 degrees turn on a 100m radius
+	}
+	return Track(pieces);
+}
+
+double Track::cte(double x, double y, int& hint) const
+{
+	int n = int(xs.size());
+	int best = hint;
+	double bestd2 = -1;
+	// the car moves less than a few points per time step, so a local search is enough
+	for (int k = -30; k <= 30; k++)
+	{
+		int i = ((hint + k) % n + n) % n;
+		double dx = x - xs[i], dy = y - ys[i];
+		double d2 = dx * dx + dy * dy;
+		if (bestd2 < 0 || d2 < bestd2)
+		{
+			bestd2 = d2;
+			best = i;
+		}
+	}
+	hint = best;
+	// distance from the tangent line of the nearest point, positive to the right
+	double h = headings[best];
+	return -(cos(h) * (y - ys[best]) - sin(h) * (x - xs[best]));
+}
+
+// VehicleSim
+
+VehicleSim::VehicleSim(const Track& _track, double _dt)
+	: track(_track)
+{
+	dt = _dt;
+	wheelbase = 2.7;
+	max_steer = 25;
+	steer_lag = 0.1;
+	max_accel = 5;
+	drag = 0.0025;
+	rolling = 0.3;
+	reset();
+}
+
+void VehicleSim::reset(double lateral_offset)
+{
+	heading = track.start_heading();
+	// right is -90 degrees from the heading
+	x = track.start_x() + lateral_offset * sin(heading);
+	y = track.start_y() - lateral_offset * cos(heading);
+	v = 0;
+	wheel = 0;
+	hint = 0;
+	cur_cte = track.cte(x, y, hint);
+	offtrack = false;
+	travelled = 0;
+	elapsed = 0;
+}
+
+Telemetry VehicleSim::telemetry() const
+{
+	Telemetry t;
+	t.cte = cur_cte;
+	t.speed = v * MPH_PER_MS;
+	t.angle = wheel;
+	t.seq = 0;
+	return t;
+}
+
+void VehicleSim::step(double steer_value, double throttle)
+{
+	if (steer_value > 1) steer_value = 1;
+	if (steer_value < -1) steer_value = -1;
+	if (throttle > 1) throttle = 1;
+	if (throttle < 0) throttle = 0;
+
+	// first order lag of the steering actuator
+	double target = steer_value * max_steer;
+	wheel += (target - wheel) * (1 - exp(-dt / steer_lag));
+
+	// kinematic bicycle model, positive wheel angle turns right ( clockwise )
+	double delta = -wheel / 180.0 * M_PI;
+	x += v * cos(heading) * dt;
+	y += v * sin(heading) * dt;
+	heading += v / wheelbase * tan(delta) * dt;
+
+	double accel = max_accel * throttle - drag * v * v - (v > 0 ? rolling : 0);
+	v += accel * dt;
+	if (v < 0) v = 0;
+
+	travelled += v * dt;
+	elapsed += dt;
+	cur_cte = track.cte(x, y, hint);
+	if (fabs(cur_cte) > track.half_width)
+		offtrack = true;
+}
@@ -0,0 +1,100 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+#include <vector>
+#include "telemetry.h"
+
+// One piece of a track: a straight line ( curvature = 0 ) or an arc.
+struct TrackPiece {
+	double length;				// meters
+	double curvature;			// 1/radius in 1/meters, positive turns left
+};
+
+// Track class:
+//   The center line of a closed race track, sampled into points every meter. It's built from straights and arcs.
+class Track {
+
+public:
+	explicit Track(const std::vector<TrackPiece>& pieces, double half_width = 4.0);
+
+	// A stadium shaped track with S-bends on both straights, loosely resembling the lake track of the Udacity simulator
+	static Track default_track();
+
+	/**
+	* Calculate the cross track error of a position
+	* @param x, y The position
+	* @param hint The index of the nearest center line point found at the previous call, it's updated. ( the search is local around it )
+	* @output The signed distance from the center line, positive if the position is right of it
+	*/
+	double cte(double x, double y, int& hint) const;
+
+	// The start position and heading ( the first point of the center line )
+	double start_x() const { return xs[0]; }
+	double start_y() const { return ys[0]; }
+	double start_heading() const { return headings[0]; }
+
+	double length() const { return double(xs.size()) * step; }
+	double half_width;			// the car is off the track if |cte| is bigger than this
+
+private:
+	static const double step;
+	std::vector<double> xs, ys, headings;
+};
+
+// VehicleSim class:
+//   A deterministic, headless stand-in for the Unity simulator. It drives a kinematic bicycle model car on a Track with a fixed time step,
+//   and produces the same telemetry ( cte, speed, steering_angle ) as the simulator, while consuming the steer / throttle control values.
+//   As it does not wait for anything, it runs much faster than real time.
+class VehicleSim {
+
+public:
+	/**
+	* Construct the simulator
+	* @param _track The track to drive on, it must outlive the simulator
+	* @param _dt The simulated time between two telemetry messages (seconds)
+	*/
+	explicit VehicleSim(const Track& _track, double _dt = 0.05);
+
+	/**
+	* Put the car to the start of the track, standing still
+	* @param lateral_offset Initial distance from the center line, positive to the right (meters)
+	*/
+	void reset(double lateral_offset = 0);
+
+	// The current telemetry of the car, like the simulator sends it
+	Telemetry telemetry() const;
+
+	/**
+	* Advance the simulation with one time step
+	* @param steer_value The steering control in the [-1,1] interval, positive turns right
+	* @param throttle The gas pedal in the [0,1] interval
+	*/
+	void step(double steer_value, double throttle);
+
+	bool off_track() const { return offtrack; }
+	double distance() const { return travelled; }		// meters travelled since the reset
+	double time() const { return elapsed; }				// seconds simulated since the reset
+	double step_time() const { return dt; }				// seconds simulated by one step()
+
+	// Car parameters
+	double wheelbase;			// meters
+	double max_steer;			// degrees of wheel angle at steer_value = 1
+	double steer_lag;			// time constant of the steering actuator (seconds)
+	double max_accel;			// m/s^2 at full throttle
+	double drag;				// aerodynamic drag, 1/m  ( decelaration = drag * v^2 )
+	double rolling;				// rolling resistance deceleration, m/s^2
+
+private:
+	const Track& track;
+	double dt;
+
+	double x, y, heading;		// position (meters) and heading (radians, counter-clockwise)
+	double v;					// speed (m/s)
+	double wheel;				// current wheel angle (degrees, positive right)
+	double cur_cte;
+	int hint;
+	bool offtrack;
+	double travelled;
+	double elapsed;
+};
+
+#endif  // SIMULATOR_H
@@ -0,0 +1,67 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+#include <stddef.h>
+#include <atomic>
+
+// SpscRing class:
+//   A bounded, lock-free queue between exactly one producer thread and one consumer thread.
+//   The producer only writes the head and the consumer only writes the tail, so push() and pop() are a copy and one release store,
+//   without any read-modify-write operation. Both sides cache the last seen position of the other side, and only load it again
+//   ( pulling its cache line over ) when the ring looks full or empty.
+//   SIZE must be a power of 2.
+template <typename T, size_t SIZE>
+class SpscRing {
+
+	static_assert((SIZE & (SIZE - 1)) == 0, "The size of the ring must be a power of 2");
+
+public:
+	SpscRing() : head(0), tail_cache(0), tail(0), head_cache(0) {}
+
+	// Producer: append an item. Returns false if the ring is full.
+	bool push(const T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail_cache == SIZE)
+		{
+			tail_cache = tail.load(std::memory_order_acquire);
+			if (h - tail_cache == SIZE)
+				return false;
+		}
+		items[h & (SIZE - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: remove the oldest item. Returns false if the ring is empty.
+	bool pop(T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head_cache)
+		{
+			head_cache = head.load(std::memory_order_acquire);
+			if (t == head_cache)
+				return false;
+		}
+		item = items[t & (SIZE - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Either side: check if there's nothing in the ring ( it may change at any time )
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	// the producer and the consumer positions are on separate cache lines, so the two threads don't invalidate each other's writes
+	// ( padded instead of alignas, so the ring can be allocated with new before C++17 )
+	static const size_t CACHE_LINE = 64;
+	char pad0[CACHE_LINE];
+	std::atomic<size_t> head;
+	size_t tail_cache;				// the producer's copy of tail
+	char pad1[CACHE_LINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+	std::atomic<size_t> tail;
+	size_t head_cache;				// the consumer's copy of head
+	char pad2[CACHE_LINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+	T items[SIZE];
+};
+
+#endif  // SPSC_RING_H
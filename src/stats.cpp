@@ -0,0 +1,155 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "stats.h"
+
+double RunningStats::stddev() const
+{
+	return sqrt(variance());
+}
+
+// P2Quantile
+
+P2Quantile::P2Quantile(double _p)
+{
+	p = _p;
+	reset();
+}
+
+void P2Quantile::reset()
+{
+	n = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		q[i] = 0;
+		pos[i] = i + 1;
+	}
+	desired[0] = 1;
+	desired[1] = 1 + 2 * p;
+	desired[2] = 1 + 4 * p;
+	desired[3] = 3 + 2 * p;
+	desired[4] = 5;
+	increment[0] = 0;
+	increment[1] = p / 2;
+	increment[2] = p;
+	increment[3] = (1 + p) / 2;
+	increment[4] = 1;
+}
+
+double P2Quantile::parabolic(int i, int d) const
+{
+	return q[i] + d / (pos[i + 1] - pos[i - 1]) *
+		((pos[i] - pos[i - 1] + d) * (q[i + 1] - q[i]) / (pos[i + 1] - pos[i]) +
+		 (pos[i + 1] - pos[i] - d) * (q[i] - q[i - 1]) / (pos[i] - pos[i - 1]));
+}
+
+double P2Quantile::linear(int i, int d) const
+{
+	return q[i] + d * (q[i + d] - q[i]) / (pos[i + d] - pos[i]);
+}
+
+void P2Quantile::add(double x)
+{
+	if (n < 5)
+	{
+		q[n++] = x;
+		if (n == 5)
+			std::sort(q, q + 5);
+		return;
+	}
+	n++;
+
+	// the cell of the new value, the extreme markers are moved if it's outside
+	int k;
+	if (x < q[0])
+	{
+		q[0] = x;
+		k = 0;
+	}
+	else if (x >= q[4])
+	{
+		q[4] = x;
+		k = 3;
+	}
+	else
+	{
+		k = 0;
+		while (x >= q[k + 1])
+			k++;
+	}
+	for (int i = k + 1; i < 5; i++)
+		pos[i]++;
+	for (int i = 0; i < 5; i++)
+		desired[i] += increment[i];
+
+	// adjust the middle markers if they are off their desired positions by one or more
+	for (int i = 1; i < 4; i++)
+	{
+		double off = desired[i] - pos[i];
+		if ((off >= 1 && pos[i + 1] - pos[i] > 1) || (off <= -1 && pos[i - 1] - pos[i] < -1))
+		{
+			int d = off > 0 ? 1 : -1;
+			double h = parabolic(i, d);
+			q[i] = (q[i - 1] < h && h < q[i + 1]) ? h : linear(i, d);
+			pos[i] += d;
+		}
+	}
+}
+
+double P2Quantile::value() const
+{
+	if (n == 0)
+		return 0;
+	if (n < 5)
+	{
+		// the nearest rank of the stored values ( an insertion sort, std::sort of a variable length trips -Warray-bounds of GCC 12 at -O2 )
+		double sorted[5];
+		for (long i = 0; i < n; i++)
+		{
+			long j = i;
+			for (; j > 0 && sorted[j - 1] > q[i]; j--)
+				sorted[j] = sorted[j - 1];
+			sorted[j] = q[i];
+		}
+		int rank = int(ceil(p * n)) - 1;
+		return sorted[std::max(0, std::min(int(n) - 1, rank))];
+	}
+	return q[2];
+}
+
+bool parse_objective(const char* name, Objective& objective)
+{
+	if (strcmp(name, "mean") == 0)
+		objective.kind = Objective::MEAN;
+	else if (strcmp(name, "meanstd") == 0)
+		objective.kind = Objective::MEAN_STD;
+	else if (strcmp(name, "max") == 0)
+		objective.kind = Objective::MAX;
+	else if (name[0] == 'p')
+	{
+		char* end;
+		double percent = strtod(name + 1, &end);
+		if (end == name + 1 || *end != '\0' || percent <= 0 || percent >= 100)
+			return false;
+		objective.kind = Objective::QUANTILE;
+		objective.quantile = percent / 100;
+	}
+	else
+		return false;
+	return true;
+}
+
+double RunStats::value(const Objective& objective) const
+{
+	switch (objective.kind) {
+	case Objective::MEAN_STD:
+		return cost.mean() + cost.stddev();
+	case Objective::QUANTILE:
+		return cost_quantile.value();
+	case Objective::MAX:
+		return cost.max();
+	default:
+		return cost.mean();
+	}
+}
@@ -0,0 +1,111 @@
+#ifndef STATS_H
+#define STATS_H
+
+// RunningStats class:
+//   The count, mean, variance and maximum of a stream of values, in constant memory. ( Welford's algorithm )
+class RunningStats {
+
+public:
+	RunningStats() { reset(); }
+
+	void reset() {
+		n = 0;
+		avg = m2 = 0;
+		maxvalue = 0;
+	}
+
+	void add(double x) {
+		n++;
+		double delta = x - avg;
+		avg += delta / n;
+		m2 += delta * (x - avg);
+		if (n == 1 || x > maxvalue)
+			maxvalue = x;
+	}
+
+	long count() const { return n; }
+	double mean() const { return avg; }
+	double variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+	double stddev() const;
+	double max() const { return maxvalue; }
+
+private:
+	long n;
+	double avg;
+	double m2;					// the sum of the squared differences from the mean
+	double maxvalue;
+};
+
+// P2Quantile class:
+//   Estimates a quantile of a stream of values in constant memory, with the P-square algorithm ( R. Jain and I. Chlamtac, 1985 ).
+//   It keeps 5 markers: the minimum, the maximum, the quantile and two halfway points, and moves them toward their desired positions
+//   with a piecewise parabolic interpolation as the values arrive. The first 5 values are stored, and the quantile is exact for them.
+class P2Quantile {
+
+public:
+	/**
+	* Construct the estimator
+	* @param _p The quantile to estimate, in the [0,1] interval ( e.g. 0.99 )
+	*/
+	explicit P2Quantile(double _p = 0.5);
+
+	void reset();
+	void add(double x);
+
+	// The estimated quantile of the values added so far ( 0 if there was none )
+	double value() const;
+
+	double quantile() const { return p; }
+
+private:
+	double parabolic(int i, int d) const;
+	double linear(int i, int d) const;
+
+	double p;
+	long n;
+	double q[5];				// the heights of the markers
+	double pos[5];				// the actual positions of the markers
+	double desired[5];			// the desired positions of the markers
+	double increment[5];		// the increments of the desired positions
+};
+
+// The statistic of the per-sample cost values which is used as the cost value of a simulation run
+struct Objective {
+	enum Kind {
+		MEAN,					// the average ( the original cost value )
+		MEAN_STD,				// the average plus the standard deviation
+		QUANTILE,				// a quantile, e.g. the 99th percentile
+		MAX,					// the worst sample
+	} kind = MEAN;
+	double quantile = 0.99;		// the quantile of QUANTILE
+};
+
+// Parse an objective: mean, meanstd, max, or p<percent> ( e.g. p99, p99.9 ). Returns false if it's invalid.
+bool parse_objective(const char* name, Objective& objective);
+
+// The statistics of the samples of a simulation run, for the objectives other than the mean
+struct RunStats {
+	RunningStats cost;			// the per-sample cost values
+	P2Quantile cost_quantile;	// the quantile of the per-sample cost values
+	double max_abs_cte;
+
+	RunStats() : max_abs_cte(0) {}
+
+	void reset() {
+		cost.reset();
+		cost_quantile.reset();
+		max_abs_cte = 0;
+	}
+
+	void add(double sample_cost, double abs_cte) {
+		cost.add(sample_cost);
+		cost_quantile.add(sample_cost);
+		if (abs_cte > max_abs_cte)
+			max_abs_cte = abs_cte;
+	}
+
+	// The value of an objective
+	double value(const Objective& objective) const;
+};
+
+#endif  // STATS_H
@@ -0,0 +1,322 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry.h"
+#include "dtoa.h"
+
+// A forward-only cursor over the received message
+struct Cursor {
+	const char* p;
+	const char* end;
+
+	bool eof() const { return p >= end; }
+
+	static bool is_ws(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+	void skip_ws() {
+		while (p < end && is_ws(*p)) p++;
+	}
+
+	// consume the character c (after whitespaces) if it's the next one
+	bool accept(char c) {
+		skip_ws();
+		if (p < end && *p == c) {
+			p++;
+			return true;
+		}
+		return false;
+	}
+
+	// consume the literal word ( null, true, false ) if it's the next one
+	bool accept_word(const char* w) {
+		size_t n = strlen(w);
+		skip_ws();
+		if (size_t(end - p) >= n && memcmp(p, w, n) == 0) {
+			p += n;
+			return true;
+		}
+		return false;
+	}
+
+	// read a JSON string, without unescaping it. [s, s+len) will point into the original buffer.
+	bool string(const char*& s, size_t& len) {
+		if (!accept('"')) return false;
+		s = p;
+		while (p < end && *p != '"') {
+			if (*p == '\\') p++;
+			p++;
+		}
+		if (p >= end) return false;
+		len = size_t(p - s);
+		p++;
+		return true;
+	}
+
+	// skip any JSON value (string, number, literal, object or array)
+	bool skip_value() {
+		skip_ws();
+		if (eof()) return false;
+		if (*p == '"') {
+			const char* s;
+			size_t len;
+			return string(s, len);
+		}
+		if (*p == '{' || *p == '[') {
+			int depth = 0;
+			while (p < end) {
+				if (*p == '"') {
+					const char* s;
+					size_t len;
+					if (!string(s, len)) return false;
+					continue;
+				}
+				if (*p == '{' || *p == '[') depth++;
+				else if (*p == '}' || *p == ']') {
+					if (--depth == 0) {
+						p++;
+						return true;
+					}
+				}
+				p++;
+			}
+			return false;
+		}
+		// number or literal
+		while (p < end && *p != ',' && *p != '}' && *p != ']') p++;
+		return true;
+	}
+
+	// read a number, which may be quoted (the simulator sends them as strings)
+	bool number(double& v) {
+		const char* s;
+		size_t len;
+		skip_ws();
+		if (eof()) return false;
+		if (*p == '"') {
+			if (!string(s, len)) return false;
+		}
+		else {
+			s = p;
+			while (p < end && *p != ',' && *p != '}' && *p != ']' && !is_ws(*p)) p++;
+			len = size_t(p - s);
+		}
+		// strtod needs a terminated string, so the (short) number is copied to the stack
+		char buf[64];
+		if (len == 0 || len >= sizeof(buf)) return false;
+		memcpy(buf, s, len);
+		buf[len] = 0;
+		char* numend;
+		v = strtod(buf, &numend);
+		return numend == buf + len;
+	}
+};
+
+static bool equals(const char* s, size_t len, const char* lit) {
+	return strlen(lit) == len && memcmp(s, lit, len) == 0;
+}
+
+// Read the numeric fields of a JSON object. The other fields are skipped.
+// The bit i of the returned mask is set if keys[i] was found and stored into *values[i]. -1 is returned if the object is malformed.
+static int decode_fields(Cursor& c, const char* const* keys, double* const* values, int n)
+{
+	int found = 0;
+	if (!c.accept('{'))
+		return -1;
+	if (c.accept('}'))
+		return found;
+	do {
+		const char* key;
+		size_t keylen;
+		if (!c.string(key, keylen) || !c.accept(':'))
+			return -1;
+		int i = 0;
+		while (i < n && !equals(key, keylen, keys[i])) i++;
+		bool ok;
+		if (i < n) {
+			ok = c.number(*values[i]);
+			found |= 1 << i;
+		}
+		else {
+			ok = c.skip_value();
+		}
+		if (!ok)
+			return -1;
+	} while (c.accept(','));
+	if (!c.accept('}'))
+		return -1;
+	return found;
+}
+
+// Read the 42[" event name ", part of a message. NONE, MANUAL or OTHER is returned if the message has no data object to decode.
+static bool decode_event(Cursor& c, const char*& name, size_t& namelen, MessageKind& kind)
+{
+	// "42" at the start of the message means there's a websocket message event.
+	// The 4 signifies a websocket message
+	// The 2 signifies a websocket event
+	if (c.end - c.p <= 2 || c.p[0] != '4' || c.p[1] != '2') {
+		kind = MessageKind::NONE;
+		return false;
+	}
+	c.p += 2;
+	if (!c.accept('[')) {
+		kind = MessageKind::MANUAL;
+		return false;
+	}
+	if (!c.string(name, namelen)) {
+		kind = MessageKind::OTHER;
+		return false;
+	}
+	if (!c.accept(',') || c.accept_word("null")) {
+		kind = MessageKind::MANUAL;
+		return false;
+	}
+	return true;
+}
+
+MessageKind decode_message(const char* data, size_t length, Telemetry& out)
+{
+	static const char* const keys[] = { "cte", "speed", "steering_angle", "seq" };
+	double* const values[] = { &out.cte, &out.speed, &out.angle, &out.seq };
+	out.seq = 0;
+
+	Cursor c = { data, data + length };
+	const char* name;
+	size_t namelen;
+	MessageKind kind;
+	if (!decode_event(c, name, namelen, kind))
+		return kind;
+	if (!equals(name, namelen, "telemetry"))
+		return MessageKind::OTHER;
+	int found = decode_fields(c, keys, values, 4);
+	return found >= 0 && (found & 7) == 7 ? MessageKind::TELEMETRY : MessageKind::OTHER;
+}
+
+MessageKind decode_reply(const char* data, size_t length, double& steer_value, double& throttle, double* seq)
+{
+	static const char* const keys[] = { "steering_angle", "throttle", "seq" };
+	double seqvalue = 0;
+	double* const values[] = { &steer_value, &throttle, &seqvalue };
+	if (seq)
+		*seq = 0;
+
+	Cursor c = { data, data + length };
+	const char* name;
+	size_t namelen;
+	MessageKind kind;
+	if (!decode_event(c, name, namelen, kind))
+		return kind;
+	if (equals(name, namelen, "reset"))
+	{
+		// only the seq field of the reset is decoded
+		if (seq && decode_fields(c, keys + 2, values + 2, 1) > 0)
+			*seq = seqvalue;
+		return MessageKind::RESET;
+	}
+	if (equals(name, namelen, "manual"))
+		return MessageKind::MANUAL;
+	if (!equals(name, namelen, "steer"))
+		return MessageKind::OTHER;
+	int found = decode_fields(c, keys, values, 3);
+	if (found < 0 || (found & 3) != 3)
+		return MessageKind::OTHER;
+	if (seq)
+		*seq = seqvalue;
+	return MessageKind::STEER;
+}
+
+// ReplyWriter
+
+static const char STEER_PREFIX[] = "42[\"steer\",{\"steering_angle\":";
+static const char STEER_MIDDLE[] = ",\"throttle\":";
+static const char STEER_SUFFIX[] = "}]";
+static const char TELEMETRY_PREFIX[] = "42[\"telemetry\",{\"cte\":\"";
+static const char TELEMETRY_SPEED[] = "\",\"speed\":\"";
+static const char TELEMETRY_ANGLE[] = "\",\"steering_angle\":\"";
+static const char TELEMETRY_SUFFIX[] = "\"}]";
+static const char RESET_MSG[] = "42[\"reset\",{}]";
+static const char RESET_SEQ_PREFIX[] = "42[\"reset\",{\"seq\":";
+static const char SEQ_FIELD[] = ",\"seq\":";
+static const char MANUAL_MSG[] = "42[\"manual\",{}]";
+
+ReplyWriter::ReplyWriter()
+{
+	len = 0;
+	buf[0] = 0;
+}
+
+void ReplyWriter::append(const char* s, size_t n)
+{
+	memcpy(buf + len, s, n);
+	len += n;
+	buf[len] = 0;
+}
+
+void ReplyWriter::append_double(double v)
+{
+	// JSON has no representation for these
+	if (!isfinite(v))
+		v = 0;
+
+	len += format_double(v, buf + len);
+}
+
+size_t ReplyWriter::steer(double steer_value, double throttle, double seq)
+{
+	len = 0;
+	append(STEER_PREFIX, sizeof(STEER_PREFIX) - 1);
+	append_double(steer_value);
+	append(STEER_MIDDLE, sizeof(STEER_MIDDLE) - 1);
+	append_double(throttle);
+	if (seq != 0)
+	{
+		append(SEQ_FIELD, sizeof(SEQ_FIELD) - 1);
+		append_double(seq);
+	}
+	append(STEER_SUFFIX, sizeof(STEER_SUFFIX) - 1);
+	return len;
+}
+
+size_t ReplyWriter::reset(double seq)
+{
+	len = 0;
+	if (seq != 0)
+	{
+		append(RESET_SEQ_PREFIX, sizeof(RESET_SEQ_PREFIX) - 1);
+		append_double(seq);
+		append(STEER_SUFFIX, sizeof(STEER_SUFFIX) - 1);
+	}
+	else
+	{
+		append(RESET_MSG, sizeof(RESET_MSG) - 1);
+	}
+	return len;
+}
+
+size_t ReplyWriter::manual()
+{
+	len = 0;
+	append(MANUAL_MSG, sizeof(MANUAL_MSG) - 1);
+	return len;
+}
+
+size_t ReplyWriter::telemetry(const Telemetry& t)
+{
+	len = 0;
+	append(TELEMETRY_PREFIX, sizeof(TELEMETRY_PREFIX) - 1);
+	append_double(t.cte);
+	append(TELEMETRY_SPEED, sizeof(TELEMETRY_SPEED) - 1);
+	append_double(t.speed);
+	append(TELEMETRY_ANGLE, sizeof(TELEMETRY_ANGLE) - 1);
+	append_double(t.angle);
+	if (t.seq != 0)
+	{
+		append("\"", 1);
+		append(SEQ_FIELD, sizeof(SEQ_FIELD) - 1);
+		append_double(t.seq);
+		append(STEER_SUFFIX, sizeof(STEER_SUFFIX) - 1);
+		return len;
+	}
+	append(TELEMETRY_SUFFIX, sizeof(TELEMETRY_SUFFIX) - 1);
+	return len;
+}
@@ -0,0 +1,82 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+#include <cstddef>
+
+// The values of one "telemetry" event sent by the simulator
+struct Telemetry {
+	double cte;					// cross track error
+	double speed;				// current speed of the car (mph)
+	double angle;				// current steering angle of the car (degrees)
+	double seq;					// the optional "seq" field, which is echoed in the reply ( 0 if there is none, the simulator doesn't send it )
+};
+
+// The kind of a websocket message, as recognised by decode_message() and decode_reply()
+enum class MessageKind {
+	NONE,						// not a socket.io event message ( does not start with "42" )
+	TELEMETRY,					// a "telemetry" event with all of the cte/speed/steering_angle fields
+	MANUAL,						// an event without data ( null ), the simulator is in manual mode
+	STEER,						// a "steer" reply with the steering_angle and throttle fields
+	RESET,						// a "reset" reply, which restarts the simulation
+	OTHER,						// any other, unknown or incomplete event
+};
+
+/**
+ * Decode an incoming websocket message of the simulator in a single pass.
+ * It works directly on the received buffer ( it does not need to be zero terminated ), and does not allocate any memory.
+ * The recognised shape is: 42["telemetry",{"cte":"0.7598","speed":"0.4380","steering_angle":"0.0000", ...}]
+ * The field values can be either JSON strings containing a number (as the simulator sends them), or plain JSON numbers.
+ * An optional "seq" field is also decoded ( a sequence number of a load generator, echoed in the reply to match them up ).
+ * @param data, length The received message
+ * @param out The decoded values are stored here ( only valid if TELEMETRY is returned )
+ * @output The kind of the message
+ */
+MessageKind decode_message(const char* data, size_t length, Telemetry& out);
+
+/**
+ * Decode a reply of the controller, the counterpart of decode_message() for the simulator side.
+ * @param data, length The received message
+ * @param steer_value, throttle The control values are stored here ( only valid if STEER is returned )
+ * @param seq If not null, the "seq" field of a STEER or RESET reply is stored here ( 0 if there is none )
+ * @output The kind of the message: STEER, RESET, MANUAL, OTHER or NONE
+ */
+MessageKind decode_reply(const char* data, size_t length, double& steer_value, double& throttle, double* seq = nullptr);
+
+// ReplyWriter class:
+//   Formats the reply messages for the simulator into its own, reusable buffer, so no memory is allocated per message.
+//   The constant parts of the "steer" message are precomputed, only the 2 numbers are formatted on every call.
+//   The content of the buffer is valid until the next call of any of the formatting methods.
+class ReplyWriter {
+
+public:
+	ReplyWriter();
+
+	/**
+	* Format a 42["steer",{"steering_angle":...,"throttle":...}] message
+	* @param steer_value, throttle The control values to send
+	* @param seq The "seq" field of the telemetry it answers, it's only added if it's not 0
+	* @output The length of the message
+	*/
+	size_t steer(double steer_value, double throttle, double seq = 0);
+
+	// Format a 42["reset",{}] message, which restarts the simulation ( with the "seq" field of the telemetry it answers, if it's not 0 )
+	size_t reset(double seq = 0);
+
+	// Format a 42["manual",{}] message
+	size_t manual();
+
+	// Format a 42["telemetry",{"cte":"...","speed":"...","steering_angle":"..."}] message, as the simulator sends it ( and the "seq" field if it's not 0 )
+	size_t telemetry(const Telemetry& t);
+
+	const char* data() const { return buf; }
+	size_t length() const { return len; }
+
+private:
+	// Append the shortest decimal representation of v which reads back as the same double ( @see format_double() )
+	void append_double(double v);
+	void append(const char* s, size_t n);
+
+	char buf[256];
+	size_t len;
+};
+
+#endif  // TELEMETRY_H
@@ -0,0 +1,169 @@
+#include <string.h>
+#include "trace.h"
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+static const char TRACE_MAGIC[8] = { 'P', 'I', 'D', 'T', 'R', 'A', 'C', 'E' };
+static const uint32_t TRACE_VERSION = 1;
+
+#ifndef _WIN32
+// Allocate the disk space of a file of the given size. Returns false if there is not enough space.
+static bool preallocate(int fd, off_t size)
+{
+#ifdef __APPLE__
+	fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0 };
+	if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+		return false;
+	return ftruncate(fd, size) == 0;
+#else
+	return posix_fallocate(fd, 0, size) == 0;
+#endif
+}
+#endif
+
+TraceWriter::TraceWriter()
+{
+	fd = -1;
+	mapsize = 0;
+	header = nullptr;
+	records = nullptr;
+	dropped = 0;
+}
+
+TraceWriter::~TraceWriter()
+{
+	close();
+}
+
+bool TraceWriter::open(const char* path, uint64_t capacity)
+{
+	close();
+#ifndef _WIN32
+	fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	mapsize = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+	void* map = MAP_FAILED;
+	// the disk blocks are allocated up front: a sparse file would allocate them on the control path, at the first write of every page,
+	// and a full disk would kill the process with SIGBUS. The pages are also faulted in now, where the platform can do it.
+	if (preallocate(fd, off_t(mapsize)))
+	{
+		int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		flags |= MAP_POPULATE;
+#endif
+		map = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, flags, fd, 0);
+	}
+	if (map == MAP_FAILED)
+	{
+		::close(fd);
+		fd = -1;
+		unlink(path);
+		return false;
+	}
+	header = static_cast<TraceHeader*>(map);
+	records = reinterpret_cast<TraceRecord*>(header + 1);
+	memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header->version = TRACE_VERSION;
+	header->record_size = sizeof(TraceRecord);
+	header->capacity = capacity;
+	header->count = 0;
+	dropped = 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void TraceWriter::close()
+{
+#ifndef _WIN32
+	if (!header)
+		return;
+	size_t used = sizeof(TraceHeader) + header->count * sizeof(TraceRecord);
+	header->capacity = header->count;
+	munmap(header, mapsize);
+	if (ftruncate(fd, off_t(used)) != 0)
+	{
+		// the file stays at its preallocated size, the header still tells the valid length
+	}
+	::close(fd);
+	fd = -1;
+	header = nullptr;
+	records = nullptr;
+#endif
+}
+
+// TraceReader
+
+TraceReader::TraceReader()
+{
+	fd = -1;
+	mapsize = 0;
+	map = nullptr;
+	records = nullptr;
+	count = 0;
+}
+
+TraceReader::~TraceReader()
+{
+	close();
+}
+
+bool TraceReader::open(const char* path)
+{
+	close();
+#ifndef _WIN32
+	fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(TraceHeader))
+	{
+		close();
+		return false;
+	}
+	mapsize = size_t(st.st_size);
+	map = mmap(nullptr, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		map = nullptr;
+		close();
+		return false;
+	}
+	const TraceHeader* header = static_cast<const TraceHeader*>(map);
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header->version != TRACE_VERSION || header->record_size != sizeof(TraceRecord))
+	{
+		close();
+		return false;
+	}
+	records = reinterpret_cast<const TraceRecord*>(header + 1);
+	count = header->count;
+	// a file cut short ( e.g. the recording process was killed while it was copied )
+	uint64_t available = (mapsize - sizeof(TraceHeader)) / sizeof(TraceRecord);
+	if (count > available)
+		count = available;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void TraceReader::close()
+{
+#ifndef _WIN32
+	if (map)
+		munmap(map, mapsize);
+	if (fd >= 0)
+		::close(fd);
+#endif
+	fd = -1;
+	map = nullptr;
+	records = nullptr;
+	count = 0;
+}
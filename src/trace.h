@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <stddef.h>
+
+// One recorded control step. The layout is fixed, it's stored as is in the trace files.
+struct TraceRecord {
+	uint64_t timestamp;			// monotonic time of receiving the telemetry (ns)
+	double cte;
+	double speed;
+	double angle;
+	double steer;				// the reply
+	double throttle;
+	double p_error;				// the components of the steering PID controller
+	double i_error;
+	double d_error;
+};
+
+// The header at the beginning of a trace file
+struct TraceHeader {
+	char magic[8];				// "PIDTRACE"
+	uint32_t version;
+	uint32_t record_size;		// sizeof(TraceRecord)
+	uint64_t capacity;			// the number of preallocated records
+	uint64_t count;				// the number of valid records
+};
+
+// TraceWriter class:
+//   Records control steps into a preallocated, memory-mapped file. Appending a record is only a copy into the mapping and
+//   an update of the count in the header, so it's cheap enough to be always on. If the file is full, the new records are dropped.
+//   The file is truncated to the recorded length when it's closed. ( only supported on POSIX systems )
+class TraceWriter {
+
+public:
+	TraceWriter();
+	~TraceWriter();
+
+	/**
+	* Create a trace file
+	* @param path The file to create
+	* @param capacity The maximum number of records
+	* @output false if the file could not be created, its disk space allocated ( the whole capacity ), or mapped
+	*/
+	bool open(const char* path, uint64_t capacity);
+
+	void append(const TraceRecord& rec) {
+		if (header->count < header->capacity)
+			records[header->count++] = rec;
+		else
+			dropped++;
+	}
+
+	bool is_open() const { return header != nullptr; }
+	uint64_t count() const { return header ? header->count : 0; }
+	uint64_t dropped;			// the records which did not fit into the file
+
+	void close();
+
+private:
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	int fd;
+	size_t mapsize;
+	TraceHeader* header;
+	TraceRecord* records;
+};
+
+// TraceReader class:
+//   Maps a trace file read-only for offline analysis and replay.
+class TraceReader {
+
+public:
+	TraceReader();
+	~TraceReader();
+
+	// Open a trace file. false if it does not exist or it's not a valid trace.
+	bool open(const char* path);
+	void close();
+
+	uint64_t size() const { return count; }
+	const TraceRecord& operator[](uint64_t i) const { return records[i]; }
+	const TraceRecord* begin() const { return records; }
+	const TraceRecord* end() const { return records + count; }
+
+private:
+	TraceReader(const TraceReader&) = delete;
+	TraceReader& operator=(const TraceReader&) = delete;
+
+	int fd;
+	size_t mapsize;
+	void* map;
+	const TraceRecord* records;
+	uint64_t count;
+};
+
+#endif  // TRACE_H
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+#include "offline_trainer.h"
+#include "logger.h"
+
+// pid_train: train the steering PID controller against the headless simulator ( VehicleSim ), faster than real time.
+//   pid_train [--runs=N] [--tolerance=T] [--speed=S] [--offset=M] [--samples=N] [--threads=N] [--scales=N] [--optimizer=NAME] [--checkpoint=<path>] [--stop-...] [--score-...] [--cost=TERMS] [--objective=NAME] [--timing=NAME] [--log-file=<path>] [P I D PDelta IDelta DDelta]
+//     --runs			The maximum number of simulation runs ( 1000 by default )
+//     --tolerance		Stop if the step size of the optimizer ( the sum of the twiddle deltas ) gets smaller than this
+//     --speed			The target speed of the car ( 50 by default, like in training mode of the pid application )
+//     --offset		The initial distance of the car from the center line in every run
+//     --samples		The length of one simulation run ( 4500 by default )
+//     --threads		Use the parallel twiddle ( ParallelTwiddle ) on this many threads, 0 means one per CPU core
+//     --scales		The number of step scales in a round of the parallel twiddle ( 6 probes each ), 0 ( default ) means enough to keep
+//					all the threads busy ( at most 8, the maximum ). The results depend on it, but not on the number of threads.
+//     --optimizer		The optimization algorithm: twiddle ( default ), nelder-mead, coordinate or cmaes. ( not used with --threads )
+//     --checkpoint	Save the state of the training into this file after every run, and resume from it if it exists ( not used with --threads )
+//     --stop-cte=M, --stop-cost, --stop-speed=S, --stop-warmup=N	Stop the hopeless runs early ( see parse_early_stop_option() )
+//     --score-skip=N, --score-last=N, --score-range=A:B	Score only a part of every run ( see parse_score_window_option() )
+//     --cost			The terms of the cost value, a comma separated list of cte ( always used ), speed and angle. ( cte by default )
+//     --objective		The statistic of the sample costs which is the cost value of a run: mean ( default ), meanstd, max, or a percentile like p99
+//     --timing		The time step of the I and D terms: speed ( the 100/speed proxy, default ) or measured ( the step of the simulator )
+//     --log-file		Write the log of the PIDTRAINER to this file
+int main(int argc, char **argv)
+{
+	SessionConfig config;
+	OfflineConfig offline;
+	config.training = true;
+	config.optimal_speed = 50;
+
+	int threads = -1;
+	int scales = 0;
+	int n = 0;
+	char* positional[6];
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (strncmp(arg, "--runs=", 7) == 0)
+			offline.max_runs = atoi(arg + 7);
+		else if (strncmp(arg, "--tolerance=", 12) == 0)
+			offline.tolerance = atof(arg + 12);
+		else if (strncmp(arg, "--speed=", 8) == 0)
+			config.optimal_speed = atof(arg + 8);
+		else if (strncmp(arg, "--offset=", 9) == 0)
+			offline.offset = atof(arg + 9);
+		else if (strncmp(arg, "--samples=", 10) == 0)
+			config.train_samplenum = atoi(arg + 10);
+		else if (strncmp(arg, "--threads=", 10) == 0)
+			threads = atoi(arg + 10);
+		else if (strncmp(arg, "--scales=", 9) == 0)
+		{
+			scales = atoi(arg + 9);
+			if (scales < 0 || scales > ParallelTwiddle::MAX_SCALES)
+			{
+				std::cerr << "The number of scales must be 0 to " << ParallelTwiddle::MAX_SCALES << ": " << (arg + 9) << std::endl;
+				return -1;
+			}
+		}
+		else if (strncmp(arg, "--optimizer=", 12) == 0)
+		{
+			if (!parse_optimizer(arg + 12, config.optimizer))
+			{
+				std::cerr << "Unknown optimizer: " << (arg + 12) << std::endl;
+				return -1;
+			}
+		}
+		else if (parse_early_stop_option(arg, config.early_stop))
+			continue;
+		else if (parse_score_window_option(arg, config.score_window))
+			continue;
+		else if (strncmp(arg, "--cost=", 7) == 0)
+		{
+			if (!parse_cost_terms(arg + 7, config.cost_terms))
+			{
+				std::cerr << "Unknown cost terms: " << (arg + 7) << std::endl;
+				return -1;
+			}
+		}
+		else if (strncmp(arg, "--objective=", 12) == 0)
+		{
+			if (!parse_objective(arg + 12, config.objective))
+			{
+				std::cerr << "Unknown objective: " << (arg + 12) << std::endl;
+				return -1;
+			}
+		}
+		else if (strncmp(arg, "--timing=", 9) == 0)
+		{
+			if (!parse_timing(arg + 9, config.timing))
+			{
+				std::cerr << "Unknown timing: " << (arg + 9) << std::endl;
+				return -1;
+			}
+		}
+		else if (strncmp(arg, "--checkpoint=", 13) == 0)
+			config.checkpoint = arg + 13;
+		else if (strncmp(arg, "--log-file=", 11) == 0)
+		{
+			if (!Logger::instance().open_file(LogChannel::TRAINING, arg + 11))
+				std::cerr << "Failed to create log file " << (arg + 11) << std::endl;
+		}
+		else if (arg[0] != '-' || (arg[1] >= '0' && arg[1] <= '9') || arg[1] == '.')
+		{
+			if (n == 6)
+			{
+				std::cerr << "Too many arguments" << std::endl;
+				return -1;
+			}
+			positional[n++] = argv[i];
+		}
+		else
+		{
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return -1;
+		}
+	}
+	if (n == 6)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			config.params[i] = atof(positional[i]);
+			config.deltas[i] = atof(positional[3 + i]);
+		}
+	}
+	else if (n != 0)
+	{
+		std::cerr << "Usage: pid_train [options] [P I D PDelta IDelta DDelta]" << std::endl;
+		return -1;
+	}
+
+	Track track = Track::default_track();
+	if (threads >= 0)
+	{
+		ParallelTwiddle twiddle(config, track, threads, scales);
+		int runs = twiddle.train(offline);
+		LOG(LogChannel::CONSOLE, LogLevel::INFO, "Runs: {} Best err: {} Params: {} {} {} Deltas: {} {} {}", runs, twiddle.best_err,
+			twiddle.params[0], twiddle.params[1], twiddle.params[2], twiddle.deltas[0], twiddle.deltas[1], twiddle.deltas[2]);
+		Logger::instance().flush();
+		return 0;
+	}
+
+	VehicleSim sim(track);
+	Session session(config);
+
+	train_offline(session, sim, offline);
+
+	const PIDTRAINER& trainer = *session.trainer;
+	LOG(LogChannel::CONSOLE, LogLevel::INFO, "Runs: {} Best err: {} Params: {} {} {} Step size: {}", trainer.runs, trainer.best_err,
+		trainer.best_params[0], trainer.best_params[1], trainer.best_params[2], trainer.optimizer->step_size());
+	Logger::instance().flush();
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// WorkerPool class:
+//   A fixed set of threads executing batches of independent tasks. run() blocks until every task of the batch is finished.
+//   The tasks are picked up in order, but they can finish in any order, so the results must be stored by task index.
+class WorkerPool {
+
+public:
+	// Start the threads. 0 means one per CPU core.
+	explicit WorkerPool(int threads = 0) {
+		if (threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		stopping = false;
+		next_task = task_count = finished = 0;
+		for (int i = 0; i < threads; i++)
+			workers.emplace_back(&WorkerPool::work, this, i);
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto& w : workers)
+			w.join();
+	}
+
+	int size() const { return int(workers.size()); }
+
+	/**
+	* Execute a batch of tasks on the threads of the pool
+	* @param count The number of tasks
+	* @param task Called with ( task index, worker index ) for every task. A worker executes one task at a time.
+	*/
+	void run(int count, const std::function<void(int, int)>& task) {
+		std::unique_lock<std::mutex> lock(mutex);
+		current = &task;
+		next_task = 0;
+		task_count = count;
+		finished = 0;
+		wakeup.notify_all();
+		done.wait(lock, [this] { return finished == task_count; });
+		current = nullptr;
+	}
+
+private:
+	void work(int worker) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			wakeup.wait(lock, [this] { return stopping || next_task < task_count; });
+			if (stopping)
+				return;
+			int idx = next_task++;
+			const std::function<void(int, int)>* task = current;
+			lock.unlock();
+			(*task)(idx, worker);
+			lock.lock();
+			if (++finished == task_count)
+				done.notify_all();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable done;
+	const std::function<void(int, int)>* current = nullptr;
+	int next_task, task_count, finished;
+	bool stopping;
+};
+
+#endif  // WORKER_POOL_H